@@ -0,0 +1,496 @@
+/***
+  This file is part of padevchooser.
+
+  padevchooser is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  padevchooser is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with padevchooser; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* Runs pa_browser against the fake Avahi daemon in fake-avahi.c and
+ * reports how fast it is. The network is either described by a trace
+ * file or made up from the command line. A trace has one command per
+ * line, '#' starts a comment:
+ *
+ *   publish KIND NAME IFACE PROTO ADDRESS PORT [KEY=VALUE ...]
+ *   withdraw KIND NAME IFACE PROTO
+ *   all-for-now
+ *   state running|connecting|failure
+ *   wait MSEC
+ *   settle
+ *
+ * KIND is one of server, sink and source, PROTO one of inet and
+ * inet6. Names can't contain white space. "settle" runs the main loop
+ * until every service published or changed since the last "settle"
+ * has been reported by the browser. Services are told apart by their
+ * names only. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <avahi-common/strlst.h>
+
+#include <pulse/mainloop.h>
+#include <pulse/timeval.h>
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/macro.h>
+#include <pulsecore/hashmap.h>
+#include <pulsecore/idxset.h>
+
+#include "../browser.h"
+#include "fake-avahi.h"
+
+#define SETTLE_TIMEOUT_USEC (30*PA_USEC_PER_SEC)
+
+/* What we know about a service we published */
+struct service {
+    char *name;
+    pa_usec_t published_at;
+    pa_bool_t pending;
+};
+
+static pa_mainloop *mainloop = NULL;
+static pa_browser *browser = NULL;
+static pa_browse_flags_t flags = PA_BROWSE_FOR_SERVERS|PA_BROWSE_FOR_SINKS|PA_BROWSE_FOR_SOURCES;
+static pa_hashmap *services = NULL;
+static unsigned n_pending = 0;
+static unsigned long n_events = 0;
+static pa_browse_histogram latency;
+
+static pa_usec_t now_usec(void) {
+    struct timeval tv;
+
+    return pa_timeval_load(pa_gettimeofday(&tv));
+}
+
+static const char *kind_to_type(const char *kind) {
+    if (!strcmp(kind, "server"))
+        return "_pulse-server._tcp.";
+    if (!strcmp(kind, "sink"))
+        return "_pulse-sink._tcp.";
+    if (!strcmp(kind, "source"))
+        return "_pulse-source._tcp.";
+
+    return NULL;
+}
+
+static int parse_proto(const char *s, AvahiProtocol *proto) {
+    if (!strcmp(s, "inet"))
+        *proto = AVAHI_PROTO_INET;
+    else if (!strcmp(s, "inet6"))
+        *proto = AVAHI_PROTO_INET6;
+    else
+        return -1;
+
+    return 0;
+}
+
+static void reported(pa_browse_opcode_t c, const char *name) {
+    struct service *s;
+
+    n_events++;
+
+    /* A removal may still be on its way when the service is back */
+    if (c == PA_BROWSE_REMOVE_SERVER || c == PA_BROWSE_REMOVE_SINK || c == PA_BROWSE_REMOVE_SOURCE)
+        return;
+
+    if (!(s = pa_hashmap_get(services, name)) || !s->pending)
+        return;
+
+    pa_browse_histogram_add(&latency, now_usec() - s->published_at);
+    s->pending = FALSE;
+
+    pa_assert(n_pending > 0);
+    n_pending--;
+}
+
+static void browse_cb(pa_browser *z, pa_browse_opcode_t c, const pa_browse_info *i, void *userdata) {
+    reported(c, i->name);
+}
+
+static void browse_batch_cb(pa_browser *z, const pa_browse_event *events, unsigned n, void *userdata) {
+    unsigned j;
+
+    for (j = 0; j < n; j++)
+        reported(events[j].opcode, events[j].info.name);
+}
+
+static void service_forget(struct service *s) {
+    if (s->pending) {
+        pa_assert(n_pending > 0);
+        n_pending--;
+    }
+
+    pa_hashmap_remove(services, s->name);
+    pa_xfree(s->name);
+    pa_xfree(s);
+}
+
+static void publish(const char *type, const char *name, AvahiIfIndex iface, AvahiProtocol proto, const char *address, uint16_t port, AvahiStringList *txt) {
+    struct service *s;
+    pa_bool_t changed = FALSE;
+
+    if ((s = pa_hashmap_get(services, name)))
+        changed = TRUE;
+    else {
+        s = pa_xnew(struct service, 1);
+        s->name = pa_xstrdup(name);
+        s->pending = FALSE;
+        pa_assert_se(pa_hashmap_put(services, s->name, s) == 0);
+    }
+
+    /* Without PA_BROWSE_TRACK_UPDATES, changes go unnoticed */
+    if (!s->pending && (!changed || (flags & PA_BROWSE_TRACK_UPDATES))) {
+        s->published_at = now_usec();
+        s->pending = TRUE;
+        n_pending++;
+    }
+
+    fake_avahi_publish(type, name, iface, proto, NULL, address, port, txt);
+}
+
+static void withdraw(const char *type, const char *name, AvahiIfIndex iface, AvahiProtocol proto) {
+    struct service *s;
+
+    if (fake_avahi_withdraw(type, name, iface, proto) < 0)
+        fprintf(stderr, "%s is not published\n", name);
+
+    if ((s = pa_hashmap_get(services, name)))
+        service_forget(s);
+}
+
+static void timeout_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    *(pa_bool_t*) userdata = TRUE;
+}
+
+/* Run the main loop for usec, or until nothing is pending anymore if
+ * settle is set */
+static int run(pa_usec_t usec, pa_bool_t settle) {
+    pa_mainloop_api *api = pa_mainloop_get_api(mainloop);
+    pa_time_event *e;
+    struct timeval tv;
+    pa_bool_t timeout = FALSE;
+
+    pa_gettimeofday(&tv);
+    pa_timeval_add(&tv, usec);
+    e = api->time_new(api, &tv, timeout_cb, &timeout);
+
+    while (!timeout && !(settle && n_pending <= 0))
+        if (pa_mainloop_iterate(mainloop, 1, NULL) < 0)
+            break;
+
+    api->time_free(e);
+
+    if (settle && n_pending > 0) {
+        fprintf(stderr, "%u services still not reported\n", n_pending);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int replay_line(char *line, unsigned lineno) {
+    char *argv[64], *p, *state = NULL;
+    const char *type = NULL;
+    unsigned argc = 0;
+    AvahiIfIndex iface = AVAHI_IF_UNSPEC;
+    AvahiProtocol proto = AVAHI_PROTO_UNSPEC;
+
+    if ((p = strchr(line, '#')))
+        *p = 0;
+
+    for (p = strtok_r(line, " \t\r\n", &state); p && argc < PA_ELEMENTSOF(argv); p = strtok_r(NULL, " \t\r\n", &state))
+        argv[argc++] = p;
+
+    if (argc <= 0)
+        return 0;
+
+    if ((!strcmp(argv[0], "publish") && argc >= 7) ||
+        (!strcmp(argv[0], "withdraw") && argc == 5)) {
+
+        if (!(type = kind_to_type(argv[1])) || parse_proto(argv[4], &proto) < 0)
+            goto fail;
+
+        iface = atoi(argv[3]);
+    }
+
+    if (type && !strcmp(argv[0], "publish")) {
+        AvahiStringList *txt = NULL;
+        unsigned j;
+
+        /* avahi_string_list_add() prepends */
+        for (j = argc; j > 7; j--)
+            txt = avahi_string_list_add(txt, argv[j-1]);
+
+        publish(type, argv[2], iface, proto, argv[5], (uint16_t) atoi(argv[6]), txt);
+
+    } else if (type && !strcmp(argv[0], "withdraw"))
+        withdraw(type, argv[2], iface, proto);
+
+    else if (!strcmp(argv[0], "all-for-now") && argc == 1)
+        fake_avahi_all_for_now();
+
+    else if (!strcmp(argv[0], "state") && argc == 2) {
+
+        if (!strcmp(argv[1], "running"))
+            fake_avahi_set_state(AVAHI_CLIENT_S_RUNNING);
+        else if (!strcmp(argv[1], "connecting"))
+            fake_avahi_set_state(AVAHI_CLIENT_CONNECTING);
+        else if (!strcmp(argv[1], "failure"))
+            fake_avahi_set_state(AVAHI_CLIENT_FAILURE);
+        else
+            goto fail;
+
+    } else if (!strcmp(argv[0], "wait") && argc == 2)
+        return run((pa_usec_t) atoi(argv[1]) * PA_USEC_PER_MSEC, FALSE);
+
+    else if (!strcmp(argv[0], "settle") && argc == 1)
+        return run(SETTLE_TIMEOUT_USEC, TRUE);
+
+    else
+        goto fail;
+
+    return 0;
+
+fail:
+    fprintf(stderr, "line %u: cannot parse '%s'\n", lineno, argv[0]);
+    return -1;
+}
+
+static int replay_file(const char *fn) {
+    FILE *f;
+    char line[1024];
+    unsigned lineno = 0;
+    int r = 0;
+
+    if (!(f = fopen(fn, "r"))) {
+        fprintf(stderr, "fopen(%s): %s\n", fn, strerror(errno));
+        return -1;
+    }
+
+    while (r >= 0 && fgets(line, sizeof(line), f))
+        r = replay_line(line, ++lineno);
+
+    fclose(f);
+    return r;
+}
+
+static void publish_sink(unsigned k, unsigned version) {
+    char name[64], buf[64];
+    AvahiStringList *txt = NULL;
+
+    snprintf(name, sizeof(name), "sink%u@host%u", k, k);
+
+    txt = avahi_string_list_add(txt, "rate=44100");
+    txt = avahi_string_list_add(txt, "channels=2");
+    txt = avahi_string_list_add(txt, "format=s16le");
+    snprintf(buf, sizeof(buf), "device=sink%u", k);
+    txt = avahi_string_list_add(txt, buf);
+    snprintf(buf, sizeof(buf), "fqdn=host%u.local", k);
+    txt = avahi_string_list_add(txt, buf);
+    snprintf(buf, sizeof(buf), "description=Sink %u, version %u", k, version);
+    txt = avahi_string_list_add(txt, buf);
+
+    snprintf(buf, sizeof(buf), "10.%u.%u.%u", (k >> 16) & 0xFF, (k >> 8) & 0xFF, k & 0xFF);
+
+    publish("_pulse-sink._tcp.", name, 2, AVAHI_PROTO_INET, buf, 4713, txt);
+}
+
+static void withdraw_sink(unsigned k) {
+    char name[64];
+
+    snprintf(name, sizeof(name), "sink%u@host%u", k, k);
+    withdraw("_pulse-sink._tcp.", name, 2, AVAHI_PROTO_INET);
+}
+
+/* Publish n sinks, then in every round let churn percent of them go
+ * away and come back, and change the data of as many others */
+static int replay_generated(unsigned n, unsigned churn, unsigned rounds) {
+    unsigned k, r, m;
+
+    for (k = 0; k < n; k++)
+        publish_sink(k, 0);
+
+    fake_avahi_all_for_now();
+
+    if (run(SETTLE_TIMEOUT_USEC, TRUE) < 0)
+        return -1;
+
+    m = n * churn / 100;
+
+    for (r = 0; r < rounds && m > 0; r++) {
+        unsigned first = (r * m * 2) % n;
+
+        for (k = 0; k < m; k++)
+            withdraw_sink((first + k) % n);
+
+        for (k = 0; k < m; k++) {
+            publish_sink((first + k) % n, r + 1);
+            publish_sink((first + m + k) % n, r + 1);
+        }
+
+        if (run(SETTLE_TIMEOUT_USEC, TRUE) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void dump_histogram(const char *stage, const pa_browse_histogram *h) {
+    if (h->count <= 0)
+        return;
+
+    printf("%-10s n=%llu mean=%lluus p50<=%lluus p95<=%lluus p99<=%lluus max=%lluus\n",
+           stage,
+           (unsigned long long) h->count,
+           (unsigned long long) (h->sum / h->count),
+           (unsigned long long) pa_browse_histogram_percentile(h, 50),
+           (unsigned long long) pa_browse_histogram_percentile(h, 95),
+           (unsigned long long) pa_browse_histogram_percentile(h, 99),
+           (unsigned long long) h->max);
+}
+
+static void report(pa_usec_t wall) {
+    pa_browser_stats stats;
+    fake_avahi_stats fstats;
+    struct rusage ru;
+    pa_usec_t cpu;
+    uint64_t n;
+
+    pa_browser_get_stats(browser, &stats);
+    fake_avahi_get_stats(&fstats);
+    getrusage(RUSAGE_SELF, &ru);
+
+    cpu = pa_timeval_load(&ru.ru_utime) + pa_timeval_load(&ru.ru_stime);
+
+    /* Everything the browser had to react to */
+    n = stats.browse_events + stats.resolves_found + stats.resolves_failed;
+
+    printf("services   %u published, %u visible, %u known\n", fstats.records, stats.n_services, stats.n_entries);
+    printf("avahi      %llu browse events, %lu resolves, peak %u resolvers\n",
+           (unsigned long long) stats.browse_events, fstats.resolvers_started, fstats.peak_resolvers);
+    printf("callbacks  %llu calls, %lu events\n", (unsigned long long) stats.callbacks, n_events);
+    printf("throughput %.0f events/s cpu, %.0f events/s wall\n",
+           cpu > 0 ? (double) n * PA_USEC_PER_SEC / (double) cpu : 0.0,
+           wall > 0 ? (double) n * PA_USEC_PER_SEC / (double) wall : 0.0);
+    printf("peak rss   %ld KiB\n", ru.ru_maxrss);
+
+    dump_histogram("queue", &stats.latency[PA_BROWSE_STAGE_QUEUE]);
+    dump_histogram("resolve", &stats.latency[PA_BROWSE_STAGE_RESOLVE]);
+    dump_histogram("deliver", &stats.latency[PA_BROWSE_STAGE_DELIVER]);
+    dump_histogram("end-to-end", &latency);
+}
+
+static void usage(const char *argv0) {
+    printf("%s [options] [TRACE]\n\n"
+           "  -n SERVICES  Sinks to make up if no trace is given (1000)\n"
+           "  -c PERCENT   Sinks that go away and come back per round (0)\n"
+           "  -r ROUNDS    Rounds of churn (10)\n"
+           "  -u           Track updates\n"
+           "  -m NUMBER    Concurrent resolvers (browser default)\n"
+           "  -d MSEC      Time a resolver takes (0)\n"
+           "  -b MSEC      Use the batch callback with this window\n",
+           argv0);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned n = 1000, churn = 0, rounds = 10, max_resolvers = 0;
+    long batch = -1;
+    const char *error = NULL;
+    struct service *s;
+    pa_usec_t start;
+    int c, r;
+
+    while ((c = getopt(argc, argv, "n:c:r:um:d:b:h")) >= 0) {
+        switch (c) {
+            case 'n':
+                n = (unsigned) atoi(optarg);
+                break;
+            case 'c':
+                churn = (unsigned) atoi(optarg);
+                break;
+            case 'r':
+                rounds = (unsigned) atoi(optarg);
+                break;
+            case 'u':
+                flags |= PA_BROWSE_TRACK_UPDATES;
+                break;
+            case 'm':
+                max_resolvers = (unsigned) atoi(optarg);
+                break;
+            case 'd':
+                fake_avahi_set_resolve_delay((pa_usec_t) atoi(optarg) * PA_USEC_PER_MSEC);
+                break;
+            case 'b':
+                batch = atol(optarg);
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (churn > 50) {
+        fprintf(stderr, "Churn must not exceed 50%%\n");
+        return 1;
+    }
+
+    mainloop = pa_mainloop_new();
+    services = pa_hashmap_new(pa_idxset_string_hash_func, pa_idxset_string_compare_func);
+
+    if (!(browser = pa_browser_new_full(pa_mainloop_get_api(mainloop), flags, max_resolvers, &error))) {
+        fprintf(stderr, "pa_browser_new_full() failed: %s\n", error);
+        return 1;
+    }
+
+    if (batch >= 0)
+        pa_browser_set_batch_callback(browser, browse_batch_cb, (pa_usec_t) batch * PA_USEC_PER_MSEC, NULL);
+    else
+        pa_browser_set_callback(browser, browse_cb, NULL);
+
+    /* Let the browsers report that there is nothing yet */
+    run(0, FALSE);
+
+    start = now_usec();
+
+    if (optind < argc)
+        r = replay_file(argv[optind]);
+    else
+        r = replay_generated(n, churn, rounds);
+
+    report(now_usec() - start);
+
+    pa_browser_unref(browser);
+
+    while ((s = pa_hashmap_first(services)))
+        service_forget(s);
+    pa_hashmap_free(services, NULL, NULL);
+
+    fake_avahi_reset();
+    pa_mainloop_free(mainloop);
+
+    return r < 0 ? 1 : 0;
+}
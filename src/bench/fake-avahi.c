@@ -0,0 +1,513 @@
+/***
+  This file is part of padevchooser.
+
+  padevchooser is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  padevchooser is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with padevchooser; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include <avahi-common/address.h>
+#include <avahi-common/domain.h>
+#include <avahi-common/error.h>
+
+#include <pulse/xmalloc.h>
+#include <pulse/timeval.h>
+
+#include <pulsecore/macro.h>
+#include <pulsecore/hashmap.h>
+#include <pulsecore/idxset.h>
+#include <pulsecore/llist.h>
+
+#include "fake-avahi.h"
+
+/* A service as published on one interface and protocol */
+struct record {
+    char *key;
+    char *type;
+    char *name;
+    AvahiIfIndex interface;
+    AvahiProtocol protocol;
+    char *host_name;
+    AvahiAddress address;
+    uint16_t port;
+    AvahiStringList *txt;
+};
+
+struct AvahiClient {
+    const AvahiPoll *poll;
+    AvahiClientState state;
+    int error;
+
+    AvahiClientCallback callback;
+    void *userdata;
+
+    PA_LLIST_HEAD(AvahiServiceBrowser, browsers);
+    PA_LLIST_HEAD(AvahiServiceResolver, resolvers);
+};
+
+struct AvahiServiceBrowser {
+    AvahiClient *client;
+    AvahiIfIndex interface;
+    AvahiProtocol protocol;
+    char *type;
+
+    /* Reports what is already published, once */
+    AvahiTimeout *timeout;
+    pa_bool_t dumped;
+
+    AvahiServiceBrowserCallback callback;
+    void *userdata;
+
+    PA_LLIST_FIELDS(AvahiServiceBrowser);
+};
+
+struct AvahiServiceResolver {
+    AvahiClient *client;
+    char *key;
+
+    /* What it was asked for, reported back on failure */
+    AvahiIfIndex interface;
+    AvahiProtocol protocol;
+    char *name, *type, *domain;
+
+    /* Delivers the result */
+    AvahiTimeout *timeout;
+
+    AvahiServiceResolverCallback callback;
+    void *userdata;
+
+    PA_LLIST_FIELDS(AvahiServiceResolver);
+};
+
+static AvahiClient *client = NULL;
+static int client_error = 0;
+static pa_usec_t resolve_delay = 0;
+static pa_hashmap *records = NULL;
+static fake_avahi_stats stats;
+static fake_avahi_resolve_cb_t resolve_callback = NULL;
+static void *resolve_userdata = NULL;
+
+static char *make_key(const char *type, const char *name, AvahiIfIndex interface, AvahiProtocol protocol) {
+    size_t l;
+    char *k;
+
+    l = strlen(type) + strlen(name) + 32;
+    k = pa_xmalloc(l);
+    snprintf(k, l, "%s\t%s\t%i\t%i", type, name, (int) interface, (int) protocol);
+
+    return k;
+}
+
+static void record_free(struct record *r) {
+    pa_assert(r);
+
+    pa_xfree(r->key);
+    pa_xfree(r->type);
+    pa_xfree(r->name);
+    pa_xfree(r->host_name);
+    avahi_string_list_free(r->txt);
+    pa_xfree(r);
+}
+
+static void schedule(AvahiTimeout **t, AvahiTimeoutCallback cb, void *userdata, pa_usec_t delay) {
+    struct timeval tv;
+
+    pa_assert(client);
+
+    pa_gettimeofday(&tv);
+    pa_timeval_add(&tv, delay);
+
+    if (*t)
+        client->poll->timeout_update(*t, &tv);
+    else
+        *t = client->poll->timeout_new(client->poll, &tv, cb, userdata);
+}
+
+static pa_bool_t browser_match(AvahiServiceBrowser *b, struct record *r) {
+    return
+        avahi_domain_equal(b->type, r->type) &&
+        (b->interface == AVAHI_IF_UNSPEC || b->interface == r->interface) &&
+        (b->protocol == AVAHI_PROTO_UNSPEC || b->protocol == r->protocol);
+}
+
+static void browser_report(AvahiServiceBrowser *b, AvahiBrowserEvent event, struct record *r) {
+    b->callback(b, r->interface, r->protocol, event, r->name, b->type, "local", 0, b->userdata);
+}
+
+static void browser_dump_cb(AvahiTimeout *t, void *userdata) {
+    AvahiServiceBrowser *b = userdata;
+    struct record *r;
+    void *state = NULL;
+
+    pa_assert(b);
+
+    b->client->poll->timeout_update(t, NULL);
+    b->dumped = TRUE;
+
+    while ((r = pa_hashmap_iterate(records, &state, NULL)))
+        if (browser_match(b, r))
+            browser_report(b, AVAHI_BROWSER_NEW, r);
+
+    b->callback(b, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, AVAHI_BROWSER_CACHE_EXHAUSTED, NULL, b->type, NULL, 0, b->userdata);
+    b->callback(b, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, AVAHI_BROWSER_ALL_FOR_NOW, NULL, b->type, NULL, 0, b->userdata);
+}
+
+static void resolver_cb(AvahiTimeout *t, void *userdata) {
+    AvahiServiceResolver *r = userdata;
+    struct record *rec;
+
+    pa_assert(r);
+
+    r->client->poll->timeout_update(t, NULL);
+    stats.resolves_answered++;
+
+    rec = pa_hashmap_get(records, r->key);
+
+    if (resolve_callback)
+        resolve_callback(FALSE, resolve_userdata);
+
+    /* The callback is free to free the resolver */
+    if (rec)
+        r->callback(r, rec->interface, rec->protocol, AVAHI_RESOLVER_FOUND,
+                    rec->name, rec->type, "local", rec->host_name, &rec->address, rec->port, rec->txt,
+                    0, r->userdata);
+    else
+        r->callback(r, r->interface, r->protocol, AVAHI_RESOLVER_FAILURE,
+                    r->name, r->type, r->domain, NULL, NULL, 0, NULL,
+                    0, r->userdata);
+
+    if (resolve_callback)
+        resolve_callback(TRUE, resolve_userdata);
+}
+
+AvahiClient* avahi_client_new(const AvahiPoll *poll_api, AvahiClientFlags flags, AvahiClientCallback callback, void *userdata, int *error) {
+    pa_assert(poll_api);
+    pa_assert(!client);
+
+    if (client_error) {
+        if (error)
+            *error = client_error;
+        return NULL;
+    }
+
+    if (!records)
+        records = pa_hashmap_new(pa_idxset_string_hash_func, pa_idxset_string_compare_func);
+
+    client = pa_xnew0(AvahiClient, 1);
+    client->poll = poll_api;
+    client->state = AVAHI_CLIENT_S_RUNNING;
+    client->callback = callback;
+    client->userdata = userdata;
+    PA_LLIST_HEAD_INIT(AvahiServiceBrowser, client->browsers);
+    PA_LLIST_HEAD_INIT(AvahiServiceResolver, client->resolvers);
+
+    /* Like the real thing, tell about the state right away */
+    if (callback)
+        callback(client, client->state, userdata);
+
+    return client;
+}
+
+void avahi_client_free(AvahiClient *c) {
+    pa_assert(c);
+    pa_assert(c == client);
+
+    while (c->browsers)
+        avahi_service_browser_free(c->browsers);
+
+    while (c->resolvers)
+        avahi_service_resolver_free(c->resolvers);
+
+    pa_xfree(c);
+    client = NULL;
+}
+
+int avahi_client_errno(AvahiClient *c) {
+    pa_assert(c);
+
+    return c->error;
+}
+
+AvahiClientState avahi_client_get_state(AvahiClient *c) {
+    pa_assert(c);
+
+    return c->state;
+}
+
+AvahiServiceBrowser* avahi_service_browser_new(
+        AvahiClient *c,
+        AvahiIfIndex interface,
+        AvahiProtocol protocol,
+        const char *type,
+        const char *domain,
+        AvahiLookupFlags flags,
+        AvahiServiceBrowserCallback callback,
+        void *userdata) {
+
+    AvahiServiceBrowser *b;
+
+    pa_assert(c);
+    pa_assert(type);
+    pa_assert(callback);
+
+    if (c->state != AVAHI_CLIENT_S_RUNNING) {
+        c->error = AVAHI_ERR_BAD_STATE;
+        return NULL;
+    }
+
+    b = pa_xnew0(AvahiServiceBrowser, 1);
+    b->client = c;
+    b->interface = interface;
+    b->protocol = protocol;
+    b->type = pa_xstrdup(type);
+    b->callback = callback;
+    b->userdata = userdata;
+    PA_LLIST_INIT(AvahiServiceBrowser, b);
+    PA_LLIST_PREPEND(AvahiServiceBrowser, c->browsers, b);
+
+    schedule(&b->timeout, browser_dump_cb, b, 0);
+
+    return b;
+}
+
+int avahi_service_browser_free(AvahiServiceBrowser *b) {
+    pa_assert(b);
+
+    if (b->timeout)
+        b->client->poll->timeout_free(b->timeout);
+
+    PA_LLIST_REMOVE(AvahiServiceBrowser, b->client->browsers, b);
+    pa_xfree(b->type);
+    pa_xfree(b);
+
+    return 0;
+}
+
+AvahiServiceResolver* avahi_service_resolver_new(
+        AvahiClient *c,
+        AvahiIfIndex interface,
+        AvahiProtocol protocol,
+        const char *name,
+        const char *type,
+        const char *domain,
+        AvahiProtocol aprotocol,
+        AvahiLookupFlags flags,
+        AvahiServiceResolverCallback callback,
+        void *userdata) {
+
+    AvahiServiceResolver *r;
+
+    pa_assert(c);
+    pa_assert(name);
+    pa_assert(type);
+    pa_assert(callback);
+
+    if (c->state != AVAHI_CLIENT_S_RUNNING) {
+        c->error = AVAHI_ERR_BAD_STATE;
+        return NULL;
+    }
+
+    r = pa_xnew0(AvahiServiceResolver, 1);
+    r->client = c;
+    r->key = make_key(type, name, interface, protocol);
+    r->interface = interface;
+    r->protocol = protocol;
+    r->name = pa_xstrdup(name);
+    r->type = pa_xstrdup(type);
+    r->domain = pa_xstrdup(domain ? domain : "local");
+    r->callback = callback;
+    r->userdata = userdata;
+    PA_LLIST_INIT(AvahiServiceResolver, r);
+    PA_LLIST_PREPEND(AvahiServiceResolver, c->resolvers, r);
+
+    schedule(&r->timeout, resolver_cb, r, resolve_delay);
+
+    stats.resolvers_started++;
+    if (++stats.live_resolvers > stats.peak_resolvers)
+        stats.peak_resolvers = stats.live_resolvers;
+
+    return r;
+}
+
+int avahi_service_resolver_free(AvahiServiceResolver *r) {
+    pa_assert(r);
+
+    if (r->timeout)
+        r->client->poll->timeout_free(r->timeout);
+
+    PA_LLIST_REMOVE(AvahiServiceResolver, r->client->resolvers, r);
+    pa_xfree(r->key);
+    pa_xfree(r->name);
+    pa_xfree(r->type);
+    pa_xfree(r->domain);
+    pa_xfree(r);
+
+    pa_assert(stats.live_resolvers > 0);
+    stats.live_resolvers--;
+
+    return 0;
+}
+
+void fake_avahi_set_resolve_delay(pa_usec_t usec) {
+    resolve_delay = usec;
+}
+
+void fake_avahi_set_resolve_callback(fake_avahi_resolve_cb_t cb, void *userdata) {
+    resolve_callback = cb;
+    resolve_userdata = userdata;
+}
+
+void fake_avahi_set_client_error(int error) {
+    client_error = error;
+}
+
+void fake_avahi_set_state(AvahiClientState state) {
+    pa_assert(client);
+
+    client->state = state;
+
+    if (state == AVAHI_CLIENT_FAILURE || state == AVAHI_CLIENT_CONNECTING)
+        client->error = AVAHI_ERR_DISCONNECTED;
+
+    if (client->callback)
+        client->callback(client, state, client->userdata);
+}
+
+void fake_avahi_publish(const char *type, const char *name, AvahiIfIndex interface, AvahiProtocol protocol, const char *host_name, const char *address, uint16_t port, AvahiStringList *txt) {
+    struct record *r;
+    char *key;
+
+    pa_assert(type);
+    pa_assert(name);
+    pa_assert(address);
+
+    if (!records)
+        records = pa_hashmap_new(pa_idxset_string_hash_func, pa_idxset_string_compare_func);
+
+    key = make_key(type, name, interface, protocol);
+
+    if ((r = pa_hashmap_get(records, key))) {
+        AvahiServiceResolver *s;
+
+        pa_xfree(key);
+        pa_xfree(r->host_name);
+        avahi_string_list_free(r->txt);
+
+        /* Resolvers still running learn about the change */
+        if (client)
+            for (s = client->resolvers; s; s = s->next)
+                if (!strcmp(s->key, r->key))
+                    schedule(&s->timeout, resolver_cb, s, resolve_delay);
+
+    } else {
+        AvahiServiceBrowser *b, *n;
+
+        r = pa_xnew0(struct record, 1);
+        r->key = key;
+        r->type = pa_xstrdup(type);
+        r->name = pa_xstrdup(name);
+        r->interface = interface;
+        r->protocol = protocol;
+        pa_assert_se(pa_hashmap_put(records, r->key, r) == 0);
+
+        if (client)
+            for (b = client->browsers; b; b = n) {
+                n = b->next;
+
+                if (b->dumped && browser_match(b, r))
+                    browser_report(b, AVAHI_BROWSER_NEW, r);
+            }
+    }
+
+    r->host_name = pa_xstrdup(host_name ? host_name : "localhost.local");
+    r->port = port;
+    r->txt = txt;
+
+    pa_assert_se(avahi_address_parse(address, AVAHI_PROTO_UNSPEC, &r->address));
+}
+
+int fake_avahi_withdraw(const char *type, const char *name, AvahiIfIndex interface, AvahiProtocol protocol) {
+    struct record *r;
+    AvahiServiceBrowser *b, *n;
+    char *key;
+
+    pa_assert(type);
+    pa_assert(name);
+
+    if (!records)
+        return -1;
+
+    key = make_key(type, name, interface, protocol);
+    r = pa_hashmap_remove(records, key);
+    pa_xfree(key);
+
+    if (!r)
+        return -1;
+
+    if (client)
+        for (b = client->browsers; b; b = n) {
+            n = b->next;
+
+            if (b->dumped && browser_match(b, r))
+                browser_report(b, AVAHI_BROWSER_REMOVE, r);
+        }
+
+    record_free(r);
+
+    return 0;
+}
+
+void fake_avahi_all_for_now(void) {
+    AvahiServiceBrowser *b, *n;
+
+    if (!client)
+        return;
+
+    for (b = client->browsers; b; b = n) {
+        n = b->next;
+
+        if (b->dumped)
+            b->callback(b, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, AVAHI_BROWSER_ALL_FOR_NOW, NULL, b->type, NULL, 0, b->userdata);
+    }
+}
+
+void fake_avahi_get_stats(fake_avahi_stats *s) {
+    pa_assert(s);
+
+    *s = stats;
+    s->records = records ? pa_hashmap_size(records) : 0;
+}
+
+void fake_avahi_reset(void) {
+    pa_assert(!client);
+
+    if (records) {
+        struct record *r;
+
+        while ((r = pa_hashmap_steal_first(records)))
+            record_free(r);
+
+        pa_hashmap_free(records, NULL, NULL);
+        records = NULL;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+}
@@ -0,0 +1,84 @@
+#ifndef foofakeavahihfoo
+#define foofakeavahihfoo
+
+/***
+  This file is part of padevchooser.
+
+  padevchooser is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  padevchooser is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with padevchooser; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#include <avahi-client/client.h>
+#include <avahi-client/lookup.h>
+#include <avahi-common/strlst.h>
+
+#include <pulse/sample.h>
+
+/* An in-process stand-in for the Avahi daemon, for benchmarks. It
+ * replaces avahi_client_new(), avahi_service_browser_new(),
+ * avahi_service_resolver_new() and their companions, so that code
+ * linked against it talks to it instead of the daemon. The network it
+ * pretends to see is made up with fake_avahi_publish() and
+ * fake_avahi_withdraw(). Browse events are delivered right away,
+ * resolver results asynchronously through the AvahiPoll the client
+ * was created with. Only a single client is supported. */
+
+typedef struct fake_avahi_stats {
+    unsigned long resolvers_started; /* Resolvers created */
+    unsigned long resolves_answered; /* Results delivered to resolvers */
+    unsigned live_resolvers;         /* Resolvers currently allocated */
+    unsigned peak_resolvers;         /* Highest number of those */
+    unsigned records;                /* Services currently published */
+} fake_avahi_stats;
+
+/* How long a resolver takes to report its result. Defaults to 0,
+ * which still means the next main loop iteration. */
+void fake_avahi_set_resolve_delay(pa_usec_t usec);
+
+/* Called right before (done is FALSE) and right after (done is TRUE)
+ * a resolver result is delivered, e.g. to measure what the code under
+ * test does with it */
+typedef void (*fake_avahi_resolve_cb_t)(int done, void *userdata);
+
+void fake_avahi_set_resolve_callback(fake_avahi_resolve_cb_t cb, void *userdata);
+
+/* Make avahi_client_new() fail with error as long as it is non-zero,
+ * as if the daemon wasn't running */
+void fake_avahi_set_client_error(int error);
+
+/* Switch the client to state and tell it about it, e.g.
+ * AVAHI_CLIENT_CONNECTING and then AVAHI_CLIENT_S_RUNNING again to
+ * simulate a daemon restart. What is published stays published. */
+void fake_avahi_set_state(AvahiClientState state);
+
+/* Announce a service on interface and protocol, or change the data of
+ * an announced one. Resolvers that are still running for it get the
+ * new data. Takes ownership of txt. */
+void fake_avahi_publish(const char *type, const char *name, AvahiIfIndex interface, AvahiProtocol protocol, const char *host_name, const char *address, uint16_t port, AvahiStringList *txt);
+
+/* Take a service off interface and protocol again. Returns a negative
+ * value if it wasn't published there. */
+int fake_avahi_withdraw(const char *type, const char *name, AvahiIfIndex interface, AvahiProtocol protocol);
+
+/* Tell all browsers that they have seen everything there is */
+void fake_avahi_all_for_now(void);
+
+void fake_avahi_get_stats(fake_avahi_stats *s);
+
+/* Drop everything that is published. Call this only after the client
+ * has been freed. */
+void fake_avahi_reset(void);
+
+#endif
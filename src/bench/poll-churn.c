@@ -0,0 +1,224 @@
+/***
+  This file is part of padevchooser.
+
+  padevchooser is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  padevchooser is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with padevchooser; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* Stress test for the AvahiWatch and AvahiTimeout pools of
+ * avahi-wrap.c. Keeps a working set of watches and timeouts of
+ * constant size, but replaces its members over and over, the way
+ * resolver churn does. Fails if the memory used keeps growing after
+ * the warm-up, i.e. if the pools grow or the heap fragments. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <pulse/mainloop.h>
+#include <pulse/timeval.h>
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/macro.h>
+#include <pulsecore/avahi-wrap.h>
+
+/* RSS may grow by this much after the warm-up */
+#define RSS_TOLERANCE_KB 256
+
+struct slot {
+    AvahiWatch *watch;
+    AvahiTimeout *timeout;
+};
+
+static AvahiPoll *avahi_poll = NULL;
+static struct slot *slots = NULL;
+static unsigned n_slots = 1000;
+static int fds[2];
+static unsigned long n_ops = 0;
+static uint32_t seed = 1;
+
+static uint32_t rnd(uint32_t n) {
+    seed = seed * 1103515245U + 12345U;
+    return (seed >> 8) % n;
+}
+
+/* Resident set size in KiB, or 0 if we can't tell */
+static unsigned long rss_kb(void) {
+    FILE *f;
+    unsigned long size, resident = 0;
+
+    if (!(f = fopen("/proc/self/statm", "r")))
+        return 0;
+
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+
+    fclose(f);
+
+    return resident * (unsigned long) sysconf(_SC_PAGESIZE) / 1024;
+}
+
+static void watch_cb(AvahiWatch *w, int fd, AvahiWatchEvent event, void *userdata) {
+}
+
+static void timeout_cb(AvahiTimeout *t, void *userdata);
+
+static void new_timeout(struct slot *s) {
+    struct timeval tv;
+
+    /* Some fire soon, some later, some never */
+    switch (rnd(3)) {
+        case 0:
+            s->timeout = avahi_poll->timeout_new(avahi_poll, NULL, timeout_cb, s);
+            break;
+
+        default:
+            pa_gettimeofday(&tv);
+            pa_timeval_add(&tv, rnd(2000) * (rnd(2) ? 1 : PA_USEC_PER_MSEC));
+            s->timeout = avahi_poll->timeout_new(avahi_poll, &tv, timeout_cb, s);
+            break;
+    }
+
+    n_ops++;
+}
+
+static void new_watch(struct slot *s) {
+    s->watch = avahi_poll->watch_new(avahi_poll, fds[0], AVAHI_WATCH_IN, watch_cb, s);
+    n_ops++;
+}
+
+/* A resolver that is done goes away, and another one takes its place */
+static void timeout_cb(AvahiTimeout *t, void *userdata) {
+    struct slot *s = userdata;
+
+    pa_assert(s->timeout == t);
+
+    avahi_poll->timeout_free(t);
+    new_timeout(s);
+}
+
+static void churn(unsigned n) {
+    struct timeval tv;
+
+    while (n-- > 0) {
+        struct slot *s = &slots[rnd(n_slots)];
+
+        switch (rnd(4)) {
+            case 0:
+                avahi_poll->watch_free(s->watch);
+                new_watch(s);
+                break;
+
+            case 1:
+                pa_gettimeofday(&tv);
+                pa_timeval_add(&tv, rnd(5000));
+                avahi_poll->timeout_update(s->timeout, rnd(2) ? &tv : NULL);
+                n_ops++;
+                break;
+
+            default:
+                avahi_poll->timeout_free(s->timeout);
+                new_timeout(s);
+                break;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long rounds = 20000, r, warm_rss, end_rss;
+    pa_avahi_poll_stats warm, end;
+    pa_mainloop *m;
+    unsigned k;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:r:")) >= 0) {
+        switch (c) {
+            case 'n':
+                n_slots = (unsigned) atoi(optarg);
+                break;
+            case 'r':
+                rounds = (unsigned long) atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "%s [-n OBJECTS] [-r ROUNDS]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (n_slots <= 0 || rounds <= 0 || pipe(fds) < 0)
+        return 1;
+
+    m = pa_mainloop_new();
+    avahi_poll = pa_avahi_poll_new(pa_mainloop_get_api(m));
+
+    slots = pa_xnew(struct slot, n_slots);
+
+    for (k = 0; k < n_slots; k++) {
+        new_watch(&slots[k]);
+        new_timeout(&slots[k]);
+    }
+
+    warm_rss = 0;
+
+    for (r = 0; r < rounds; r++) {
+        churn(n_slots / 10 + 1);
+
+        while (pa_mainloop_iterate(m, 0, NULL) > 0)
+            ;
+
+        if (r == rounds / 10) {
+            warm_rss = rss_kb();
+            pa_avahi_poll_get_stats(avahi_poll, &warm);
+        }
+    }
+
+    end_rss = rss_kb();
+    pa_avahi_poll_get_stats(avahi_poll, &end);
+
+    printf("objects    %lu allocations, %u watches and %u timeouts live, peak %u and %u\n",
+           n_ops, end.n_watch_objects, end.n_timeout_objects, end.peak_watch_objects, end.peak_timeout_objects);
+    printf("slabs      %u after warm-up, %u at the end\n", warm.n_slabs, end.n_slabs);
+    printf("rss        %lu KiB after warm-up, %lu KiB at the end\n", warm_rss, end_rss);
+    printf("timer      %llu wakeups for %llu timeout callbacks\n",
+           (unsigned long long) end.wakeups, (unsigned long long) end.timeout_callbacks);
+
+    for (k = 0; k < n_slots; k++) {
+        avahi_poll->watch_free(slots[k].watch);
+        avahi_poll->timeout_free(slots[k].timeout);
+    }
+
+    pa_xfree(slots);
+    pa_avahi_poll_free(avahi_poll);
+    pa_mainloop_free(m);
+
+    close(fds[0]);
+    close(fds[1]);
+
+    if (end.n_slabs > warm.n_slabs) {
+        fprintf(stderr, "The pools kept growing\n");
+        return 1;
+    }
+
+    if (warm_rss > 0 && end_rss > warm_rss + RSS_TOLERANCE_KB) {
+        fprintf(stderr, "RSS kept growing\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,202 @@
+/***
+  This file is part of padevchooser.
+
+  padevchooser is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  padevchooser is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with padevchooser; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* Counts the heap allocations pa_browser makes for each resolver
+ * result. With PA_BROWSE_TRACK_UPDATES the resolvers keep reporting
+ * the same data over and over, and handling that must not allocate
+ * anything. Exits with an error if it does. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <avahi-common/strlst.h>
+
+#include <pulse/mainloop.h>
+#include <pulse/timeval.h>
+
+#include <pulsecore/macro.h>
+
+#include "../browser.h"
+#include "fake-avahi.h"
+
+#ifdef __GLIBC__
+
+/* Count every allocation, whoever makes it */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static pa_bool_t counting = FALSE;
+static unsigned long n_mallocs = 0;
+
+void *malloc(size_t size) {
+    if (counting)
+        n_mallocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (counting)
+        n_mallocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (counting)
+        n_mallocs++;
+    return __libc_realloc(ptr, size);
+}
+
+#define HAVE_MALLOC_COUNT 1
+#endif
+
+static unsigned long n_events = 0;
+
+static void resolve_cb(int done, void *userdata) {
+#ifdef HAVE_MALLOC_COUNT
+    counting = !done;
+#endif
+}
+
+static void browse_cb(pa_browser *z, pa_browse_opcode_t c, const pa_browse_info *i, void *userdata) {
+    n_events++;
+}
+
+static void publish_sink(unsigned k) {
+    char name[64], buf[64];
+    AvahiStringList *txt = NULL;
+
+    snprintf(name, sizeof(name), "sink%u@host%u", k, k);
+
+    txt = avahi_string_list_add(txt, "rate=44100");
+    txt = avahi_string_list_add(txt, "channels=2");
+    txt = avahi_string_list_add(txt, "format=s16le");
+    txt = avahi_string_list_add(txt, "server-version=pulseaudio 0.9.10");
+    txt = avahi_string_list_add(txt, "user-name=lennart");
+    txt = avahi_string_list_add(txt, "cookie=0x12345678");
+    snprintf(buf, sizeof(buf), "device=sink%u", k);
+    txt = avahi_string_list_add(txt, buf);
+    snprintf(buf, sizeof(buf), "fqdn=host%u.local", k);
+    txt = avahi_string_list_add(txt, buf);
+    snprintf(buf, sizeof(buf), "description=Sink %u", k);
+    txt = avahi_string_list_add(txt, buf);
+
+    snprintf(buf, sizeof(buf), "10.%u.%u.%u", (k >> 16) & 0xFF, (k >> 8) & 0xFF, k & 0xFF);
+
+    fake_avahi_publish("_pulse-sink._tcp.", name, 2, AVAHI_PROTO_INET, NULL, buf, 4713, txt);
+}
+
+/* Run the main loop until the resolvers delivered n results in total */
+static void run(pa_mainloop *m, unsigned long n) {
+    fake_avahi_stats stats;
+
+    for (;;) {
+        fake_avahi_get_stats(&stats);
+
+        if (stats.resolves_answered >= n)
+            break;
+
+        pa_assert_se(pa_mainloop_iterate(m, 1, NULL) >= 0);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    unsigned n = 1000, rounds = 10, r, k;
+    unsigned long mallocs;
+    pa_mainloop *m;
+    pa_browser *b;
+    const char *error = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:r:")) >= 0) {
+        switch (c) {
+            case 'n':
+                n = (unsigned) atoi(optarg);
+                break;
+            case 'r':
+                rounds = (unsigned) atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "%s [-n SERVICES] [-r ROUNDS]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    m = pa_mainloop_new();
+
+    if (!(b = pa_browser_new_full(pa_mainloop_get_api(m), PA_BROWSE_FOR_SINKS|PA_BROWSE_TRACK_UPDATES, n, &error))) {
+        fprintf(stderr, "pa_browser_new_full() failed: %s\n", error);
+        return 1;
+    }
+
+    pa_browser_set_callback(b, browse_cb, NULL);
+    fake_avahi_set_resolve_callback(resolve_cb, NULL);
+
+    for (k = 0; k < n; k++)
+        publish_sink(k);
+
+#ifdef HAVE_MALLOC_COUNT
+    n_mallocs = 0;
+#endif
+
+    run(m, n);
+
+#ifdef HAVE_MALLOC_COUNT
+    printf("first resolve   %.2f mallocs per result\n", (double) n_mallocs / n);
+#endif
+
+    mallocs = 0;
+
+    for (r = 1; r <= rounds; r++) {
+
+        /* The same data again, as the resolvers report it every now
+         * and then */
+        for (k = 0; k < n; k++)
+            publish_sink(k);
+
+#ifdef HAVE_MALLOC_COUNT
+        n_mallocs = 0;
+#endif
+
+        run(m, (unsigned long) n * (r + 1));
+
+#ifdef HAVE_MALLOC_COUNT
+        mallocs += n_mallocs;
+#endif
+    }
+
+    printf("steady state    %.2f mallocs per result, %lu events for %u results\n",
+           rounds > 0 ? (double) mallocs / ((double) n * rounds) : 0.0, n_events, n * (rounds + 1));
+
+    pa_browser_unref(b);
+    fake_avahi_reset();
+    pa_mainloop_free(m);
+
+#ifndef HAVE_MALLOC_COUNT
+    printf("Allocations can't be counted on this system\n");
+#endif
+
+    /* Nothing changed, so nothing may have been reported either */
+    return mallocs > 0 || n_events != n ? 1 : 0;
+}
@@ -0,0 +1,231 @@
+/***
+  This file is part of padevchooser.
+
+  padevchooser is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  padevchooser is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with padevchooser; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* Measures what menu item tooltips cost at the scale of thousands of
+ * discovered services. Builds one menu item per service, as the menus
+ * do for every page that has been shown, in three ways:
+ *
+ *   none   no tooltips at all, as the baseline
+ *   eager  text formatted up front and kept by gtk_tooltips_set_tip(),
+ *          the way padevchooser used to do it
+ *   lazy   "has-tooltip" and a "query-tooltip" handler that formats
+ *          the text when it is shown, the way padevchooser does it now
+ *
+ * Each way runs in a process of its own, and the growth of its RSS is
+ * reported. Needs a display; without one there is nothing to measure. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <gtk/gtk.h>
+
+#include <pulse/sample.h>
+#include <pulse/timeval.h>
+
+/* What a menu_item_info knows about a service */
+struct item {
+    gchar *name, *server, *device, *description;
+    pa_sample_spec sample_spec;
+    pa_usec_t rtt;
+    GtkWidget *menu_item;
+};
+
+static struct item *items = NULL;
+static unsigned n_items = 10000;
+
+/* Resident set size in KiB, or 0 if we can't tell */
+static unsigned long rss_kb(void) {
+    FILE *f;
+    unsigned long size, resident = 0;
+
+    if (!(f = fopen("/proc/self/statm", "r")))
+        return 0;
+
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+
+    fclose(f);
+
+    return resident * (unsigned long) sysconf(_SC_PAGESIZE) / 1024;
+}
+
+/* Same text as menu_item_info_tooltip() makes for a resolved sink */
+static gchar *item_tooltip(struct item *i) {
+    char t[PA_SAMPLE_SPEC_SNPRINT_MAX];
+
+    return g_strdup_printf(
+            "Name: %s\n"
+            "Server: %s\n"
+            "Device: %s\n"
+            "Description: %s\n"
+            "Sample Specification: %s\n"
+            "Latency: %0.1f ms",
+            i->name,
+            i->server,
+            i->device,
+            i->description,
+            pa_sample_spec_snprint(t, sizeof(t), &i->sample_spec),
+            (double) i->rtt / PA_USEC_PER_MSEC);
+}
+
+static gboolean query_tooltip_cb(GtkWidget *w, gint x, gint y, gboolean keyboard_mode, GtkTooltip *tooltip, struct item *i) {
+    gchar *c;
+
+    c = item_tooltip(i);
+    gtk_tooltip_set_text(tooltip, c);
+    g_free(c);
+
+    return TRUE;
+}
+
+static void make_items(void) {
+    unsigned k;
+
+    items = g_new0(struct item, n_items);
+
+    for (k = 0; k < n_items; k++) {
+        struct item *i = &items[k];
+
+        i->name = g_strdup_printf("sink%u@host%u", k, k);
+        i->server = g_strdup_printf("tcp:10.%u.%u.%u:4713 host%u.local", (k >> 16) & 0xFF, (k >> 8) & 0xFF, k & 0xFF, k);
+        i->device = g_strdup_printf("alsa_output.pci_%u_analog_stereo", k);
+        i->description = g_strdup_printf("Built-in Audio Analog Stereo on host%u", k);
+        i->sample_spec.format = PA_SAMPLE_S16LE;
+        i->sample_spec.rate = 44100;
+        i->sample_spec.channels = 2;
+        i->rtt = 1200 + k;
+    }
+}
+
+static unsigned long run(const char *mode) {
+    GtkWidget *menu;
+    GtkTooltips *tooltips = NULL;
+    unsigned long before;
+    unsigned k;
+
+    menu = gtk_menu_new();
+    g_object_ref_sink(menu);
+
+    if (!strcmp(mode, "eager"))
+        tooltips = gtk_tooltips_new();
+
+    before = rss_kb();
+
+    for (k = 0; k < n_items; k++) {
+        struct item *i = &items[k];
+
+        i->menu_item = gtk_check_menu_item_new_with_label(i->name);
+        gtk_menu_shell_append(GTK_MENU_SHELL(menu), i->menu_item);
+        gtk_widget_show(i->menu_item);
+
+        if (tooltips) {
+            gchar *c;
+
+            c = item_tooltip(i);
+            gtk_tooltips_set_tip(tooltips, i->menu_item, c, NULL);
+            g_free(c);
+
+        } else if (!strcmp(mode, "lazy")) {
+            gtk_widget_set_has_tooltip(i->menu_item, TRUE);
+            g_signal_connect(G_OBJECT(i->menu_item), "query-tooltip", G_CALLBACK(query_tooltip_cb), i);
+        }
+    }
+
+    return rss_kb() - before;
+}
+
+int main(int argc, char *argv[]) {
+    static const char * const modes[] = { "none", "eager", "lazy" };
+    unsigned long growth[G_N_ELEMENTS(modes)];
+    unsigned j;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:")) >= 0) {
+        switch (c) {
+            case 'n':
+                n_items = (unsigned) atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "%s [-n SERVICES]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (n_items <= 0)
+        return 1;
+
+    /* Every way gets a fresh process, so that none profits from the
+     * heap another one left behind */
+    for (j = 0; j < G_N_ELEMENTS(modes); j++) {
+        int fds[2], status;
+        pid_t pid;
+
+        if (pipe(fds) < 0 || (pid = fork()) < 0) {
+            perror("fork");
+            return 1;
+        }
+
+        if (pid == 0) {
+            unsigned long r = 0;
+
+            close(fds[0]);
+
+            if (gtk_init_check(&argc, &argv)) {
+                make_items();
+                r = run(modes[j]);
+            }
+
+            if (write(fds[1], &r, sizeof(r)) != sizeof(r))
+                _exit(1);
+
+            _exit(0);
+        }
+
+        close(fds[1]);
+
+        if (read(fds[0], &growth[j], sizeof(growth[j])) != sizeof(growth[j]))
+            growth[j] = 0;
+
+        close(fds[0]);
+        waitpid(pid, &status, 0);
+
+        if (growth[j] <= 0) {
+            printf("Cannot measure without a display or /proc, skipping\n");
+            return 0;
+        }
+    }
+
+    for (j = 0; j < G_N_ELEMENTS(modes); j++)
+        printf("%-6s %6lu KiB for %u menu items, %5lu bytes per item\n",
+               modes[j], growth[j], n_items, growth[j] * 1024 / n_items);
+
+    printf("tooltips cost %lu KiB made up front, %lu KiB made on demand\n",
+           growth[1] > growth[0] ? growth[1] - growth[0] : 0,
+           growth[2] > growth[0] ? growth[2] - growth[0] : 0);
+
+    return 0;
+}
@@ -24,18 +24,28 @@
 #endif
 
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <avahi-client/lookup.h>
 #include <avahi-common/domain.h>
 #include <avahi-common/error.h>
 
 #include <pulse/xmalloc.h>
+#include <pulse/timeval.h>
 
 #include <pulsecore/log.h>
 #include <pulsecore/core-util.h>
 #include <pulsecore/avahi-wrap.h>
 #include <pulsecore/refcnt.h>
 #include <pulsecore/macro.h>
+#include <pulsecore/hashmap.h>
+#include <pulsecore/llist.h>
 
 #include "browser.h"
 
@@ -43,6 +53,148 @@
 #define SERVICE_TYPE_SOURCE "_pulse-source._tcp."
 #define SERVICE_TYPE_SERVER "_pulse-server._tcp."
 
+#define DEFAULT_MAX_RESOLVERS 8
+
+/* How long to wait after a change before rewriting the cache file */
+#define CACHE_SAVE_DELAY_USEC (5*PA_USEC_PER_SEC)
+
+/* Bounds for the exponential backoff between reconnection attempts */
+#define RECONNECT_MIN_USEC (1*PA_USEC_PER_SEC)
+#define RECONNECT_MAX_USEC (60*PA_USEC_PER_SEC)
+
+#define CACHE_MAGIC "PAbc"
+#define CACHE_VERSION 1
+#define CACHE_STRING_NULL 0xFFFFU
+
+/* Pending resolves are started in this order. Sinks come first since
+ * that's the menu people actually use, sources last. Last of all come
+ * the services we knew before a reconnect and only need to resolve
+ * again to keep track of their changes. */
+enum {
+    PRIORITY_SINK,
+    PRIORITY_SERVER,
+    PRIORITY_SOURCE,
+    PRIORITY_REFRESH,
+    N_PRIORITIES
+};
+
+/* One interface/protocol combination a service has been seen on */
+struct sighting {
+    AvahiIfIndex interface;
+    AvahiProtocol protocol;
+};
+
+/* A service that is currently visible on the network, identified by
+ * name, type and domain. A multi-homed host shows up once per
+ * interface and protocol; we keep track of all these sightings but
+ * resolve the service only once, and consider it gone only when the
+ * last sighting is. Until it is resolved the service is either
+ * waiting in one of the queues or has a resolver running. */
+struct service {
+    pa_browser *browser;
+
+    char *name, *type, *domain;
+
+    struct sighting *sightings;
+    unsigned n_sightings, max_sightings;
+
+    unsigned priority;
+    pa_bool_t queued, resolved, in_flight;
+    AvahiServiceResolver *resolver;
+    struct sighting resolver_sighting;
+    pa_usec_t queued_at, resolve_started_at;
+
+    PA_LLIST_FIELDS(struct service);
+};
+
+/* A service we have reported (or are about to report) to our user,
+ * keyed by kind and name. All strings of an entry live in the single
+ * block pointed to by strings. Entries loaded from the cache file are
+ * provisional until live discovery confirms or evicts them, and
+ * until then their strings point into the mapped cache file. Entries
+ * of services nobody asked us to resolve yet carry only their name.
+ * After losing the connection to the daemon all entries are stale
+ * until the new service browsers confirm or evict them. */
+struct entry {
+    pa_browser *browser;
+
+    pa_browse_opcode_t kind;
+    char *name, *server, *server_version, *user_name, *fqdn, *device, *description;
+    char *strings;
+    uint32_t cookie;
+    pa_sample_spec sample_spec;
+    pa_bool_t cookie_valid, sample_spec_valid;
+
+    pa_bool_t provisional, borrowed, seen, announced, named_only, stale;
+    pa_usec_t found_at;
+
+    /* Where the service was last resolved */
+    struct sighting resolved_on;
+};
+
+/* On-disk layout of the cache file: a header followed by n_entries
+ * records, each followed by its NUL terminated strings in the order
+ * name, server, server_version, user_name, fqdn, device, description
+ * and padded to a multiple of four bytes. The file is in host byte
+ * order, it is not meant to be shared between machines. */
+enum {
+    CACHE_STRING_NAME,
+    CACHE_STRING_SERVER,
+    CACHE_STRING_SERVER_VERSION,
+    CACHE_STRING_USER_NAME,
+    CACHE_STRING_FQDN,
+    CACHE_STRING_DEVICE,
+    CACHE_STRING_DESCRIPTION,
+    N_CACHE_STRINGS
+};
+
+struct cache_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t n_entries;
+    uint32_t size;
+};
+
+struct cache_record {
+    uint8_t kind;
+    uint8_t flags;
+    uint8_t channels;
+    uint8_t reserved;
+    uint32_t cookie;
+    uint32_t rate;
+    int32_t format;
+    uint16_t length[N_CACHE_STRINGS];
+    uint16_t reserved2;
+};
+
+#define CACHE_RECORD_COOKIE 1
+#define CACHE_RECORD_SAMPLE_SPEC 2
+
+/* An event waiting for delivery to the batch callback. There is at
+ * most one per service: a NEW that is followed by a REMOVE in the same
+ * batch cancels out, a REMOVE that is followed by a NEW turns into an
+ * UPDATE or, if updates aren't tracked, flushes the batch, and UPDATEs
+ * are folded into whatever is already pending. */
+struct pending_event {
+    pa_browse_opcode_t kind;
+    char *name;
+
+    pa_browse_opcode_t opcode;
+    pa_bool_t was_known;
+    struct entry *entry;
+
+    PA_LLIST_FIELDS(struct pending_event);
+};
+
+/* A pattern one field of a service has to match */
+struct filter {
+    pa_browse_flags_t kinds;
+    pa_browse_filter_field_t field;
+    char *pattern;
+
+    PA_LLIST_FIELDS(struct filter);
+};
+
 struct pa_browser {
     PA_REFCNT_DECLARE;
 
@@ -57,17 +209,153 @@ struct pa_browser {
 
     AvahiClient *client;
     AvahiServiceBrowser *server_browser, *sink_browser, *source_browser;
+    pa_bool_t reconnecting;
+    pa_time_event *reconnect_event;
+    pa_usec_t reconnect_delay;
+
+    pa_hashmap *services;
+    PA_LLIST_HEAD(struct service, queue[N_PRIORITIES]);
+    struct service *queue_tail[N_PRIORITIES];
+    unsigned n_resolvers, max_resolvers;
+
+    pa_browse_flags_t flags, resolve_flags;
+    pa_hashmap *entries;
+    PA_LLIST_HEAD(struct filter, filters);
+
+    char *cache_file;
+    void *cache_map;
+    size_t cache_map_size;
+    unsigned n_borrowed;
+    pa_defer_event *announce_event;
+    pa_time_event *save_event;
+    pa_bool_t save_pending;
+
+    pa_browse_batch_cb_t batch_callback;
+    void *batch_userdata;
+    pa_usec_t batch_window;
+    pa_hashmap *pending_events;
+    PA_LLIST_HEAD(struct pending_event, pending_head);
+    struct pending_event *pending_tail;
+    pa_defer_event *batch_defer_event;
+    pa_time_event *batch_time_event;
+    pa_bool_t batch_armed;
+    pa_browse_event *batch_buffer;
+    unsigned batch_buffer_size;
+
+    pa_browser_stats stats;
+};
+
+
+/* The TXT keys we care about. They are looked up with a perfect hash
+ * over length, first and last character of the key, see txt_hash(). */
+enum {
+    TXT_DEVICE,
+    TXT_SERVER_VERSION,
+    TXT_USER_NAME,
+    TXT_FQDN,
+    TXT_COOKIE,
+    TXT_DESCRIPTION,
+    TXT_CHANNELS,
+    TXT_RATE,
+    TXT_FORMAT,
+    N_TXT_KEYS
+};
+
+/* A single TXT string is at most 255 bytes, so this fits any value */
+#define TXT_VALUE_MAX 256
+
+#define TXT_HASH_SIZE 32
+
+static const struct {
+    const char *key;
+    size_t length;
+} txt_keys[N_TXT_KEYS] = {
+    [TXT_DEVICE] = { "device", 6 },
+    [TXT_SERVER_VERSION] = { "server-version", 14 },
+    [TXT_USER_NAME] = { "user-name", 9 },
+    [TXT_FQDN] = { "fqdn", 4 },
+    [TXT_COOKIE] = { "cookie", 6 },
+    [TXT_DESCRIPTION] = { "description", 11 },
+    [TXT_CHANNELS] = { "channels", 8 },
+    [TXT_RATE] = { "rate", 4 },
+    [TXT_FORMAT] = { "format", 6 }
+};
 
+/* Maps txt_hash() to an index into txt_keys, -1 for unused slots */
+static const int8_t txt_hash_table[TXT_HASH_SIZE] = {
+    TXT_FQDN, -1, -1, TXT_RATE, -1, -1, -1, -1,
+    -1, -1, -1, TXT_SERVER_VERSION, TXT_FORMAT, -1, TXT_CHANNELS, -1,
+    -1, -1, -1, TXT_DESCRIPTION, -1, TXT_USER_NAME, -1, -1,
+    -1, -1, TXT_COOKIE, TXT_DEVICE, -1, -1, -1, -1
 };
 
+/* The values of all TXT records we are interested in, parsed in
+ * place from the AvahiStringList into a fixed size arena on the
+ * stack. */
+struct txt_values {
+    char value[N_TXT_KEYS][TXT_VALUE_MAX];
+    pa_bool_t present[N_TXT_KEYS];
+};
+
+static unsigned txt_hash(const uint8_t *key, size_t length) {
+    return (unsigned) (3 * length + key[0] + key[length-1]) & (TXT_HASH_SIZE-1);
+}
+
+static int txt_lookup(const uint8_t *key, size_t length) {
+    int k;
+
+    if (length <= 0)
+        return -1;
+
+    if ((k = txt_hash_table[txt_hash(key, length)]) < 0)
+        return -1;
 
-int atou(const char* str, unsigned *out)
-{
-    int tmp;
-    tmp=atoi(str);
-    if(tmp < 0)
+    if (txt_keys[k].length != length || memcmp(txt_keys[k].key, key, length) != 0)
         return -1;
-    *out=tmp;
+
+    return k;
+}
+
+static void parse_txt(AvahiStringList *txt, struct txt_values *v) {
+
+    memset(v->present, 0, sizeof(v->present));
+
+    for (; txt; txt = avahi_string_list_get_next(txt)) {
+        const uint8_t *t, *eq;
+        size_t size, l;
+        int k;
+
+        t = avahi_string_list_get_text(txt);
+        size = avahi_string_list_get_size(txt);
+
+        if (!(eq = memchr(t, '=', size)))
+            continue;
+
+        if ((k = txt_lookup(t, (size_t) (eq - t))) < 0)
+            continue;
+
+        if ((l = size - (size_t) (eq - t) - 1) >= TXT_VALUE_MAX)
+            continue;
+
+        /* Later records override earlier ones */
+        memcpy(v->value[k], eq + 1, l);
+        v->value[k][l] = 0;
+        v->present[k] = TRUE;
+    }
+}
+
+/* Like atoi(), but refuses negative numbers and overflows */
+static int atou(const char *str, uint32_t *out) {
+    uint64_t r = 0;
+
+    if (*str == '-')
+        return -1;
+
+    for (; *str >= '0' && *str <= '9'; str++)
+        if ((r = r * 10 + (uint64_t) (*str - '0')) > 0xFFFFFFFFU)
+            return -1;
+
+    *out = (uint32_t) r;
     return 0;
 }
 
@@ -80,9 +368,1076 @@ static int map_to_opcode(const char *type, int new) {
     else if (avahi_domain_equal(type, SERVICE_TYPE_SERVER))
         return new ? PA_BROWSE_NEW_SERVER : PA_BROWSE_REMOVE_SERVER;
 
-    return -1;
+    return -1;
+}
+
+static unsigned map_to_priority(const char *type) {
+
+    if (avahi_domain_equal(type, SERVICE_TYPE_SINK))
+        return PRIORITY_SINK;
+    else if (avahi_domain_equal(type, SERVICE_TYPE_SERVER))
+        return PRIORITY_SERVER;
+
+    return PRIORITY_SOURCE;
+}
+
+static pa_usec_t now_usec(void) {
+    struct timeval tv;
+
+    return pa_timeval_load(pa_gettimeofday(&tv));
+}
+
+/* Account the time that passed since the given timestamp to a stage */
+static void record_latency(pa_browser *b, pa_browse_stage_t stage, pa_usec_t since) {
+    pa_usec_t now = now_usec();
+
+    /* The wall clock might have been set back */
+    pa_browse_histogram_add(&b->stats.latency[stage], now > since ? now - since : 0);
+}
+
+static pa_browse_flags_t kind_flag(pa_browse_opcode_t kind) {
+
+    switch (kind) {
+        case PA_BROWSE_NEW_SERVER:
+            return PA_BROWSE_FOR_SERVERS;
+        case PA_BROWSE_NEW_SINK:
+            return PA_BROWSE_FOR_SINKS;
+        case PA_BROWSE_NEW_SOURCE:
+            return PA_BROWSE_FOR_SOURCES;
+        default:
+            return 0;
+    }
+}
+
+static unsigned service_hash_func(const void *p) {
+    const struct service *s = p;
+
+    return
+        pa_idxset_string_hash_func(s->name) ^
+        (pa_idxset_string_hash_func(s->type) * 7) ^
+        (pa_idxset_string_hash_func(s->domain) * 13);
+}
+
+static int service_compare_func(const void *a, const void *b) {
+    const struct service *x = a, *y = b;
+    int r;
+
+    if ((r = strcmp(x->name, y->name)))
+        return r;
+    if ((r = strcmp(x->type, y->type)))
+        return r;
+
+    return strcmp(x->domain, y->domain);
+}
+
+static struct service *service_get(
+        pa_browser *b,
+        const char *name,
+        const char *type,
+        const char *domain) {
+
+    struct service t;
+
+    t.name = (char*) name;
+    t.type = (char*) type;
+    t.domain = (char*) domain;
+
+    return pa_hashmap_get(b->services, &t);
+}
+
+static int service_find_sighting(struct service *s, AvahiIfIndex interface, AvahiProtocol protocol) {
+    unsigned k;
+
+    for (k = 0; k < s->n_sightings; k++)
+        if (s->sightings[k].interface == interface &&
+            s->sightings[k].protocol == protocol)
+            return (int) k;
+
+    return -1;
+}
+
+static void service_add_sighting(struct service *s, AvahiIfIndex interface, AvahiProtocol protocol) {
+
+    if (service_find_sighting(s, interface, protocol) >= 0)
+        return;
+
+    if (s->n_sightings >= s->max_sightings) {
+        s->max_sightings = s->max_sightings > 0 ? s->max_sightings * 2 : 2;
+        s->sightings = pa_xrenew(struct sighting, s->sightings, s->max_sightings);
+    }
+
+    s->sightings[s->n_sightings].interface = interface;
+    s->sightings[s->n_sightings].protocol = protocol;
+    s->n_sightings++;
+}
+
+/* Returns TRUE if the sighting was known */
+static pa_bool_t service_remove_sighting(struct service *s, AvahiIfIndex interface, AvahiProtocol protocol) {
+    int k;
+
+    if ((k = service_find_sighting(s, interface, protocol)) < 0)
+        return FALSE;
+
+    s->sightings[k] = s->sightings[--s->n_sightings];
+    return TRUE;
+}
+
+static void service_enqueue(struct service *s) {
+    pa_browser *b;
+
+    pa_assert(s);
+    pa_assert(!s->queued);
+    pa_assert(!s->resolver);
+
+    b = s->browser;
+
+    PA_LLIST_INSERT_AFTER(struct service, b->queue[s->priority], b->queue_tail[s->priority], s);
+    b->queue_tail[s->priority] = s;
+    s->queued = TRUE;
+    s->queued_at = now_usec();
+}
+
+static void service_dequeue(struct service *s) {
+    pa_browser *b;
+
+    pa_assert(s);
+    pa_assert(s->queued);
+
+    b = s->browser;
+
+    if (b->queue_tail[s->priority] == s)
+        b->queue_tail[s->priority] = s->prev;
+
+    PA_LLIST_REMOVE(struct service, b->queue[s->priority], s);
+    s->queued = FALSE;
+}
+
+static struct service *service_new(
+        pa_browser *b,
+        AvahiIfIndex interface,
+        AvahiProtocol protocol,
+        const char *name,
+        const char *type,
+        const char *domain) {
+
+    struct service *s;
+
+    s = pa_xnew(struct service, 1);
+    s->browser = b;
+    s->name = pa_xstrdup(name);
+    s->type = pa_xstrdup(type);
+    s->domain = pa_xstrdup(domain);
+    s->sightings = NULL;
+    s->n_sightings = s->max_sightings = 0;
+    s->priority = map_to_priority(type);
+    s->queued = s->resolved = s->in_flight = FALSE;
+    s->resolver = NULL;
+    PA_LLIST_INIT(struct service, s);
+
+    service_add_sighting(s, interface, protocol);
+
+    pa_assert_se(pa_hashmap_put(b->services, s, s) == 0);
+
+    return s;
+}
+
+static void service_cancel_resolver(struct service *s) {
+    pa_browser *b;
+
+    pa_assert(s);
+    pa_assert(s->resolver);
+
+    b = s->browser;
+
+    avahi_service_resolver_free(s->resolver);
+    s->resolver = NULL;
+
+    if (s->in_flight) {
+        pa_assert(b->n_resolvers >= 1);
+        b->n_resolvers--;
+        s->in_flight = FALSE;
+    }
+}
+
+static void service_free(struct service *s) {
+    pa_browser *b;
+
+    pa_assert(s);
+
+    b = s->browser;
+
+    if (s->queued)
+        service_dequeue(s);
+
+    if (s->resolver)
+        service_cancel_resolver(s);
+
+    pa_hashmap_remove(b->services, s);
+
+    pa_xfree(s->sightings);
+    pa_xfree(s->name);
+    pa_xfree(s->type);
+    pa_xfree(s->domain);
+    pa_xfree(s);
+}
+
+static void free_services(pa_browser *b) {
+    struct service *s;
+
+    pa_assert(b);
+
+    while ((s = pa_hashmap_first(b->services)))
+        service_free(s);
+
+    pa_assert(b->n_resolvers == 0);
+}
+
+static pa_browse_opcode_t remove_opcode(pa_browse_opcode_t kind) {
+
+    switch (kind) {
+        case PA_BROWSE_NEW_SINK:
+            return PA_BROWSE_REMOVE_SINK;
+        case PA_BROWSE_NEW_SOURCE:
+            return PA_BROWSE_REMOVE_SOURCE;
+        default:
+            pa_assert(kind == PA_BROWSE_NEW_SERVER);
+            return PA_BROWSE_REMOVE_SERVER;
+    }
+}
+
+static pa_browse_opcode_t update_opcode(pa_browse_opcode_t kind) {
+
+    switch (kind) {
+        case PA_BROWSE_NEW_SINK:
+            return PA_BROWSE_UPDATE_SINK;
+        case PA_BROWSE_NEW_SOURCE:
+            return PA_BROWSE_UPDATE_SOURCE;
+        default:
+            pa_assert(kind == PA_BROWSE_NEW_SERVER);
+            return PA_BROWSE_UPDATE_SERVER;
+    }
+}
+
+static pa_bool_t is_remove_opcode(pa_browse_opcode_t opcode) {
+    return
+        opcode == PA_BROWSE_REMOVE_SERVER ||
+        opcode == PA_BROWSE_REMOVE_SINK ||
+        opcode == PA_BROWSE_REMOVE_SOURCE;
+}
+
+static pa_bool_t kind_wanted(pa_browser *b, pa_browse_opcode_t kind) {
+    return !!(b->flags & kind_flag(kind));
+}
+
+/* If there are filters on this field for this kind of service, the
+ * value has to match at least one of them */
+static pa_bool_t filter_match(pa_browser *b, pa_browse_opcode_t kind, pa_browse_filter_field_t field, const char *value) {
+    struct filter *f;
+    pa_bool_t any = FALSE;
+
+    for (f = b->filters; f; f = f->next) {
+        if (f->field != field || !(f->kinds & kind_flag(kind)))
+            continue;
+
+        if (value && fnmatch(f->pattern, value, 0) == 0)
+            return TRUE;
+
+        any = TRUE;
+    }
+
+    return !any;
+}
+
+static pa_bool_t filter_info(pa_browser *b, pa_browse_opcode_t kind, const pa_browse_info *i) {
+    char t[PA_SAMPLE_SPEC_SNPRINT_MAX];
+
+    if (!b->filters)
+        return TRUE;
+
+    return
+        filter_match(b, kind, PA_BROWSE_FILTER_NAME, i->name) &&
+        filter_match(b, kind, PA_BROWSE_FILTER_SERVER, i->server) &&
+        filter_match(b, kind, PA_BROWSE_FILTER_FQDN, i->fqdn) &&
+        filter_match(b, kind, PA_BROWSE_FILTER_DEVICE, i->device) &&
+        filter_match(b, kind, PA_BROWSE_FILTER_SAMPLE_SPEC, i->sample_spec ? pa_sample_spec_snprint(t, sizeof(t), i->sample_spec) : NULL);
+}
+
+static unsigned entry_hash_func(const void *p) {
+    const struct entry *e = p;
+
+    return pa_idxset_string_hash_func(e->name) ^ (unsigned) e->kind;
+}
+
+static int entry_compare_func(const void *a, const void *b) {
+    const struct entry *x = a, *y = b;
+
+    if (x->kind != y->kind)
+        return x->kind < y->kind ? -1 : 1;
+
+    return strcmp(x->name, y->name);
+}
+
+static struct entry *entry_get(pa_browser *b, pa_browse_opcode_t kind, const char *name) {
+    struct entry t;
+
+    t.kind = kind;
+    t.name = (char*) name;
+
+    return pa_hashmap_get(b->entries, &t);
+}
+
+static pa_bool_t streq(const char *a, const char *b) {
+
+    if (!a || !b)
+        return a == b;
+
+    return strcmp(a, b) == 0;
+}
+
+static pa_bool_t entry_equal_info(struct entry *e, const pa_browse_info *i) {
+
+    if (!streq(e->server, i->server) ||
+        !streq(e->server_version, i->server_version) ||
+        !streq(e->user_name, i->user_name) ||
+        !streq(e->fqdn, i->fqdn) ||
+        !streq(e->device, i->device) ||
+        !streq(e->description, i->description))
+        return FALSE;
+
+    if (e->cookie_valid != !!i->cookie ||
+        (i->cookie && e->cookie != *i->cookie))
+        return FALSE;
+
+    if (e->sample_spec_valid != !!i->sample_spec ||
+        (i->sample_spec && !pa_sample_spec_equal(&e->sample_spec, i->sample_spec)))
+        return FALSE;
+
+    return TRUE;
+}
+
+static void entry_to_info(struct entry *e, pa_browse_info *i) {
+
+    memset(i, 0, sizeof(*i));
+    i->name = e->name;
+    i->server = e->server;
+    i->server_version = e->server_version;
+    i->user_name = e->user_name;
+    i->fqdn = e->fqdn;
+    i->cookie = e->cookie_valid ? &e->cookie : NULL;
+    i->device = e->device;
+    i->description = e->description;
+    i->sample_spec = e->sample_spec_valid ? &e->sample_spec : NULL;
+}
+
+/* Pointers to the string fields of the entry, in cache file order */
+static void entry_strings(struct entry *e, char **d[N_CACHE_STRINGS]) {
+    d[CACHE_STRING_NAME] = &e->name;
+    d[CACHE_STRING_SERVER] = &e->server;
+    d[CACHE_STRING_SERVER_VERSION] = &e->server_version;
+    d[CACHE_STRING_USER_NAME] = &e->user_name;
+    d[CACHE_STRING_FQDN] = &e->fqdn;
+    d[CACHE_STRING_DEVICE] = &e->device;
+    d[CACHE_STRING_DESCRIPTION] = &e->description;
+}
+
+static void entry_free_strings(struct entry *e) {
+
+    if (e->borrowed) {
+        pa_assert(e->browser->n_borrowed >= 1);
+        e->browser->n_borrowed--;
+        e->borrowed = FALSE;
+        return;
+    }
+
+    pa_xfree(e->strings);
+    e->strings = NULL;
+}
+
+/* Replace the data of the entry with our own copy of the info. Since
+ * the name is the key it has to stay the same. */
+static void entry_set_info(struct entry *e, const pa_browse_info *i) {
+    const char *v[N_CACHE_STRINGS];
+    char **d[N_CACHE_STRINGS];
+    size_t l[N_CACHE_STRINGS], n = 0;
+    char *block, *p;
+    unsigned k;
+
+    pa_assert(!e->name || streq(e->name, i->name));
+
+    v[CACHE_STRING_NAME] = i->name;
+    v[CACHE_STRING_SERVER] = i->server;
+    v[CACHE_STRING_SERVER_VERSION] = i->server_version;
+    v[CACHE_STRING_USER_NAME] = i->user_name;
+    v[CACHE_STRING_FQDN] = i->fqdn;
+    v[CACHE_STRING_DEVICE] = i->device;
+    v[CACHE_STRING_DESCRIPTION] = i->description;
+
+    for (k = 0; k < N_CACHE_STRINGS; k++)
+        n += (l[k] = v[k] ? strlen(v[k]) + 1 : 0);
+
+    p = block = pa_xmalloc(n);
+
+    for (k = 0; k < N_CACHE_STRINGS; k++)
+        if (v[k]) {
+            memcpy(p, v[k], l[k]);
+            p += l[k];
+        }
+
+    entry_free_strings(e);
+    entry_strings(e, d);
+    e->strings = block;
+
+    for (k = 0, p = block; k < N_CACHE_STRINGS; k++)
+        if (v[k]) {
+            *d[k] = p;
+            p += l[k];
+        } else
+            *d[k] = NULL;
+
+    if ((e->cookie_valid = !!i->cookie))
+        e->cookie = *i->cookie;
+
+    if ((e->sample_spec_valid = !!i->sample_spec))
+        e->sample_spec = *i->sample_spec;
+}
+
+static struct entry *entry_new(pa_browser *b, pa_browse_opcode_t kind) {
+    struct entry *e;
+
+    e = pa_xnew0(struct entry, 1);
+    e->browser = b;
+    e->kind = kind;
+    e->resolved_on.interface = AVAHI_IF_UNSPEC;
+    e->resolved_on.protocol = AVAHI_PROTO_UNSPEC;
+
+    return e;
+}
+
+static void entry_free(struct entry *e) {
+    pa_assert(e);
+
+    pa_hashmap_remove(e->browser->entries, e);
+    entry_free_strings(e);
+    pa_xfree(e);
+}
+
+static void release_cache_map(pa_browser *b) {
+    pa_assert(b);
+
+    if (!b->cache_map || b->n_borrowed > 0)
+        return;
+
+    munmap(b->cache_map, b->cache_map_size);
+    b->cache_map = NULL;
+    b->cache_map_size = 0;
+}
+
+static unsigned pending_event_hash_func(const void *p) {
+    const struct pending_event *pe = p;
+
+    return pa_idxset_string_hash_func(pe->name) ^ (unsigned) pe->kind;
+}
+
+static int pending_event_compare_func(const void *a, const void *b) {
+    const struct pending_event *x = a, *y = b;
+
+    if (x->kind != y->kind)
+        return x->kind < y->kind ? -1 : 1;
+
+    return strcmp(x->name, y->name);
+}
+
+static struct pending_event *pending_event_get(pa_browser *b, pa_browse_opcode_t kind, const char *name) {
+    struct pending_event t;
+
+    t.kind = kind;
+    t.name = (char*) name;
+
+    return pa_hashmap_get(b->pending_events, &t);
+}
+
+static void pending_event_free(pa_browser *b, struct pending_event *pe) {
+
+    if (b->pending_tail == pe)
+        b->pending_tail = pe->prev;
+
+    PA_LLIST_REMOVE(struct pending_event, b->pending_head, pe);
+    pa_hashmap_remove(b->pending_events, pe);
+
+    pa_xfree(pe->name);
+    pa_xfree(pe);
+}
+
+static void flush_events(pa_browser *b) {
+    struct pending_event *pe, *head;
+    unsigned n = 0;
+
+    pa_assert(b);
+
+    b->batch_armed = FALSE;
+
+    if (b->batch_defer_event)
+        b->mainloop->defer_enable(b->batch_defer_event, 0);
+
+    if (!b->pending_head)
+        return;
+
+    if (b->batch_buffer_size < pa_hashmap_size(b->pending_events)) {
+        b->batch_buffer_size = pa_hashmap_size(b->pending_events) * 2;
+        b->batch_buffer = pa_xrenew(pa_browse_event, b->batch_buffer, b->batch_buffer_size);
+    }
+
+    /* Detach the list, so that the callback sees a consistent state */
+    head = b->pending_head;
+    b->pending_head = b->pending_tail = NULL;
+
+    for (pe = head; pe; pe = pe->next) {
+        pa_browse_event *ev = &b->batch_buffer[n++];
+
+        pa_hashmap_remove(b->pending_events, pe);
+
+        if (is_remove_opcode(pe->opcode)) {
+            memset(&ev->info, 0, sizeof(ev->info));
+            ev->info.name = pe->name;
+        } else {
+            entry_to_info(pe->entry, &ev->info);
+
+            if (pe->entry->found_at > 0) {
+                record_latency(b, PA_BROWSE_STAGE_DELIVER, pe->entry->found_at);
+                pe->entry->found_at = 0;
+            }
+        }
+
+        ev->opcode = pe->opcode;
+    }
+
+    pa_browser_ref(b);
+
+    if (b->batch_callback) {
+        b->stats.callbacks++;
+        b->stats.events_delivered += n;
+        b->batch_callback(b, b->batch_buffer, n, b->batch_userdata);
+    }
+
+    while ((pe = head)) {
+        head = pe->next;
+        pa_xfree(pe->name);
+        pa_xfree(pe);
+    }
+
+    pa_browser_unref(b);
+}
+
+static void batch_defer_event_cb(pa_mainloop_api *m, pa_defer_event *e, void *userdata) {
+    flush_events(userdata);
+}
+
+static void batch_time_event_cb(pa_mainloop_api *m, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    flush_events(userdata);
+}
+
+static void arm_batch(pa_browser *b) {
+    struct timeval tv;
+
+    if (b->batch_armed)
+        return;
+
+    if (b->batch_window == 0)
+        b->mainloop->defer_enable(b->batch_defer_event, 1);
+    else {
+        pa_gettimeofday(&tv);
+        pa_timeval_add(&tv, b->batch_window);
+
+        if (b->batch_time_event)
+            b->mainloop->time_restart(b->batch_time_event, &tv);
+        else
+            b->batch_time_event = b->mainloop->time_new(b->mainloop, &tv, batch_time_event_cb, b);
+    }
+
+    b->batch_armed = TRUE;
+}
+
+static void queue_event(pa_browser *b, struct entry *e, pa_browse_opcode_t opcode) {
+    struct pending_event *pe;
+    pa_bool_t remove = is_remove_opcode(opcode);
+
+    if ((pe = pending_event_get(b, e->kind, e->name))) {
+
+        if (remove && !pe->was_known) {
+            /* Our user never heard of it, forget about it */
+            pending_event_free(b, pe);
+            return;
+        }
+
+        if (!remove && is_remove_opcode(pe->opcode)) {
+            /* It went away and came back. Users that track updates
+             * get an UPDATE, everybody else needs to see the REMOVE
+             * before the NEW, so deliver what we have right away. */
+            if (b->flags & PA_BROWSE_TRACK_UPDATES) {
+                pe->opcode = update_opcode(e->kind);
+                pe->entry = e;
+                return;
+            }
+
+            flush_events(b);
+            pa_assert(!pending_event_get(b, e->kind, e->name));
+
+        } else {
+            /* An update doesn't change what we are going to report */
+            if (remove || opcode == e->kind)
+                pe->opcode = opcode;
+
+            pe->entry = remove ? NULL : e;
+            return;
+        }
+    }
+
+    pe = pa_xnew(struct pending_event, 1);
+    pe->kind = e->kind;
+    pe->name = pa_xstrdup(e->name);
+    pe->opcode = opcode;
+    pe->was_known = e->announced;
+    pe->entry = remove ? NULL : e;
+    PA_LLIST_INIT(struct pending_event, pe);
+
+    pa_assert_se(pa_hashmap_put(b->pending_events, pe, pe) == 0);
+    PA_LLIST_INSERT_AFTER(struct pending_event, b->pending_head, b->pending_tail, pe);
+    b->pending_tail = pe;
+
+    arm_batch(b);
+}
+
+/* Report the entry as new or, if opcode says so, updated */
+static void announce(pa_browser *b, struct entry *e, pa_browse_opcode_t opcode) {
+    pa_browse_info i;
+
+    if (b->batch_callback) {
+        queue_event(b, e, opcode);
+        e->announced = TRUE;
+        return;
+    }
+
+    if (!b->callback)
+        return;
+
+    entry_to_info(e, &i);
+    e->announced = TRUE;
+
+    if (e->found_at > 0) {
+        record_latency(b, PA_BROWSE_STAGE_DELIVER, e->found_at);
+        e->found_at = 0;
+    }
+
+    b->stats.callbacks++;
+    b->stats.events_delivered++;
+    b->callback(b, opcode, &i, b->userdata);
+}
+
+/* Report an announced entry as removed, but keep it */
+static void retract(pa_browser *b, struct entry *e) {
+    pa_browse_info i;
+
+    pa_assert(e->announced);
+
+    if (b->batch_callback)
+        queue_event(b, e, remove_opcode(e->kind));
+    else if (b->callback) {
+        memset(&i, 0, sizeof(i));
+        i.name = e->name;
+        b->stats.callbacks++;
+        b->stats.events_delivered++;
+        b->callback(b, remove_opcode(e->kind), &i, b->userdata);
+    }
+
+    e->announced = FALSE;
+}
+
+/* Drop the entry and tell our user about it if necessary */
+static void withdraw(pa_browser *b, struct entry *e) {
+
+    if (e->announced)
+        retract(b, e);
+
+    entry_free(e);
+}
+
+static void save_cache(pa_browser *b) {
+    struct cache_header h;
+    struct entry *e;
+    void *state = NULL;
+    char *fn;
+    FILE *f;
+    static const char zero[4] = { 0, 0, 0, 0 };
+    size_t size;
+
+    pa_assert(b);
+    pa_assert(b->cache_file);
+
+    fn = pa_xnew(char, strlen(b->cache_file) + 5);
+    sprintf(fn, "%s.tmp", b->cache_file);
+
+    if (!(f = fopen(fn, "w"))) {
+        pa_log_debug("Failed to open cache file %s: %s", fn, strerror(errno));
+        goto finish;
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+    h.version = CACHE_VERSION;
+    h.n_entries = 0;
+
+    /* Written again once we know the final values */
+    fwrite(&h, sizeof(h), 1, f);
+    size = sizeof(h);
+
+    while ((e = pa_hashmap_iterate(b->entries, &state, NULL))) {
+        struct cache_record r;
+        char **d[N_CACHE_STRINGS];
+        const char *v[N_CACHE_STRINGS];
+        unsigned k;
+
+        /* Nothing worth remembering yet */
+        if (e->named_only)
+            continue;
+
+        entry_strings(e, d);
+        for (k = 0; k < N_CACHE_STRINGS; k++)
+            v[k] = *d[k];
+
+        memset(&r, 0, sizeof(r));
+        r.kind = (uint8_t) e->kind;
+
+        if (e->cookie_valid) {
+            r.flags |= CACHE_RECORD_COOKIE;
+            r.cookie = e->cookie;
+        }
+
+        if (e->sample_spec_valid) {
+            r.flags |= CACHE_RECORD_SAMPLE_SPEC;
+            r.channels = e->sample_spec.channels;
+            r.rate = e->sample_spec.rate;
+            r.format = e->sample_spec.format;
+        }
+
+        for (k = 0; k < N_CACHE_STRINGS; k++) {
+            size_t l;
+
+            if (!v[k]) {
+                r.length[k] = CACHE_STRING_NULL;
+                continue;
+            }
+
+            if ((l = strlen(v[k])) >= CACHE_STRING_NULL)
+                break;
+
+            r.length[k] = (uint16_t) l;
+        }
+
+        /* Skip entries with absurdly long strings */
+        if (k < N_CACHE_STRINGS)
+            continue;
+
+        fwrite(&r, sizeof(r), 1, f);
+        size += sizeof(r);
+
+        for (k = 0; k < N_CACHE_STRINGS; k++)
+            if (v[k]) {
+                fwrite(v[k], r.length[k] + 1, 1, f);
+                size += r.length[k] + 1;
+            }
+
+        fwrite(zero, PA_ROUND_UP(size, 4) - size, 1, f);
+        size = PA_ROUND_UP(size, 4);
+
+        h.n_entries++;
+    }
+
+    h.size = (uint32_t) size;
+    rewind(f);
+    fwrite(&h, sizeof(h), 1, f);
+
+    if (ferror(f) || fclose(f) != 0) {
+        pa_log_debug("Failed to write cache file %s", fn);
+        unlink(fn);
+        goto finish;
+    }
+
+    /* Renaming keeps a mapping of the old file valid */
+    if (rename(fn, b->cache_file) < 0) {
+        pa_log_debug("Failed to rename cache file %s: %s", fn, strerror(errno));
+        unlink(fn);
+    }
+
+finish:
+    pa_xfree(fn);
+}
+
+static void save_event_cb(pa_mainloop_api *m, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    pa_browser *b = userdata;
+
+    pa_assert(b);
+
+    b->save_pending = FALSE;
+    save_cache(b);
+}
+
+/* Rewrite the cache file a little later, so that a burst of changes
+ * costs only a single write */
+static void schedule_save(pa_browser *b) {
+    struct timeval tv;
+
+    pa_assert(b);
+
+    if (!b->cache_file || b->save_pending)
+        return;
+
+    pa_gettimeofday(&tv);
+    pa_timeval_add(&tv, CACHE_SAVE_DELAY_USEC);
+
+    if (b->save_event)
+        b->mainloop->time_restart(b->save_event, &tv);
+    else
+        b->save_event = b->mainloop->time_new(b->mainloop, &tv, save_event_cb, b);
+
+    b->save_pending = TRUE;
+}
+
+static void load_cache(pa_browser *b) {
+    struct cache_header h;
+    struct stat st;
+    int fd;
+    uint8_t *p, *end;
+    uint32_t n;
+
+    pa_assert(b);
+    pa_assert(b->cache_file);
+    pa_assert(!b->cache_map);
+
+    if ((fd = open(b->cache_file, O_RDONLY)) < 0)
+        return;
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(h)) {
+        close(fd);
+        return;
+    }
+
+    b->cache_map_size = (size_t) st.st_size;
+    b->cache_map = mmap(NULL, b->cache_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (b->cache_map == MAP_FAILED) {
+        b->cache_map = NULL;
+        b->cache_map_size = 0;
+        return;
+    }
+
+    p = b->cache_map;
+    end = p + b->cache_map_size;
+
+    memcpy(&h, p, sizeof(h));
+
+    if (memcmp(h.magic, CACHE_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != CACHE_VERSION ||
+        h.size != b->cache_map_size) {
+        pa_log_debug("Ignoring invalid cache file %s", b->cache_file);
+        goto finish;
+    }
+
+    p += sizeof(h);
+
+    for (n = 0; n < h.n_entries; n++) {
+        struct cache_record r;
+        char *v[N_CACHE_STRINGS], **d[N_CACHE_STRINGS];
+        struct entry *e;
+        unsigned k;
+
+        if ((size_t) (end - p) < sizeof(r))
+            break;
+
+        memcpy(&r, p, sizeof(r));
+        p += sizeof(r);
+
+        for (k = 0; k < N_CACHE_STRINGS; k++) {
+
+            if (r.length[k] == CACHE_STRING_NULL) {
+                v[k] = NULL;
+                continue;
+            }
+
+            if ((size_t) (end - p) <= r.length[k] || p[r.length[k]] != 0)
+                break;
+
+            v[k] = (char*) p;
+            p += r.length[k] + 1;
+        }
+
+        if (k < N_CACHE_STRINGS)
+            break;
+
+        p = (uint8_t*) b->cache_map + PA_ROUND_UP((size_t) (p - (uint8_t*) b->cache_map), 4);
+
+        if (r.kind > PA_BROWSE_NEW_SOURCE ||
+            !v[CACHE_STRING_NAME] ||
+            !v[CACHE_STRING_SERVER] ||
+            (r.kind != PA_BROWSE_NEW_SERVER && !v[CACHE_STRING_DEVICE]))
+            break;
+
+        if (!kind_wanted(b, r.kind) || entry_get(b, r.kind, v[CACHE_STRING_NAME]))
+            continue;
+
+        e = entry_new(b, r.kind);
+        entry_strings(e, d);
+        for (k = 0; k < N_CACHE_STRINGS; k++)
+            *d[k] = v[k];
+
+        if ((e->cookie_valid = !!(r.flags & CACHE_RECORD_COOKIE)))
+            e->cookie = r.cookie;
+
+        if ((e->sample_spec_valid = !!(r.flags & CACHE_RECORD_SAMPLE_SPEC))) {
+            e->sample_spec.format = (pa_sample_format_t) r.format;
+            e->sample_spec.rate = r.rate;
+            e->sample_spec.channels = r.channels;
+        }
+
+        if (b->filters) {
+            pa_browse_info i;
+
+            entry_to_info(e, &i);
+
+            if (!filter_info(b, e->kind, &i)) {
+                pa_xfree(e);
+                continue;
+            }
+        }
+
+        e->provisional = TRUE;
+        e->borrowed = TRUE;
+        b->n_borrowed++;
+
+        pa_assert_se(pa_hashmap_put(b->entries, e, e) == 0);
+    }
+
+    if (n < h.n_entries)
+        pa_log_debug("Cache file %s is truncated or corrupt", b->cache_file);
+
+finish:
+    release_cache_map(b);
+}
+
+static void announce_event_cb(pa_mainloop_api *m, pa_defer_event *e, void *userdata) {
+    pa_browser *b = userdata;
+    struct entry *en;
+    void *state = NULL;
+
+    pa_assert(b);
+
+    m->defer_enable(e, 0);
+
+    if (!b->callback && !b->batch_callback)
+        return;
+
+    /* The callback might drop the last reference to us */
+    pa_browser_ref(b);
+
+    while ((en = pa_hashmap_iterate(b->entries, &state, NULL)))
+        if (en->provisional && !en->announced)
+            announce(b, en, en->kind);
+
+    pa_browser_unref(b);
+}
+
+/* A service was resolved: confirm, update or create its entry */
+static void entry_found(pa_browser *b, pa_browse_opcode_t kind, const pa_browse_info *i, const struct sighting *on) {
+    struct entry *e;
+    pa_bool_t changed = TRUE, was_named_only = FALSE;
+
+    if ((e = entry_get(b, kind, i->name))) {
+        changed = !entry_equal_info(e, i);
+
+        if (changed || e->borrowed)
+            entry_set_info(e, i);
+
+        was_named_only = e->named_only;
+        e->provisional = e->named_only = FALSE;
+    } else {
+        e = entry_new(b, kind);
+        entry_set_info(e, i);
+        pa_assert_se(pa_hashmap_put(b->entries, e, e) == 0);
+    }
+
+    e->resolved_on = *on;
+
+    if (changed)
+        schedule_save(b);
+
+    release_cache_map(b);
+
+    if (!changed && e->announced)
+        return;
+
+    e->found_at = now_usec();
+
+    if (e->announced && ((b->flags & PA_BROWSE_TRACK_UPDATES) || was_named_only))
+        announce(b, e, update_opcode(e->kind));
+    else {
+        /* A service is reported as new only once. Users that don't
+         * track updates learn about a changed one, e.g. a cached entry
+         * that turned out to be outdated, as removed and new again. */
+        if (e->announced)
+            retract(b, e);
+
+        announce(b, e, e->kind);
+    }
+}
+
+/* Report a service we have not been asked to resolve by name only */
+static void entry_named(pa_browser *b, pa_browse_opcode_t kind, const char *name) {
+    struct entry *e;
+    pa_browse_info i;
+
+    memset(&i, 0, sizeof(i));
+    i.name = name;
+
+    e = entry_new(b, kind);
+    entry_set_info(e, &i);
+    e->named_only = TRUE;
+    pa_assert_se(pa_hashmap_put(b->entries, e, e) == 0);
+
+    announce(b, e, kind);
+}
+
+/* Evict provisional and stale entries of the given kind that live
+ * discovery did not see */
+static void sweep_provisional(pa_browser *b, pa_browse_opcode_t kind) {
+    struct entry *e;
+    void *state = NULL;
+    pa_bool_t changed = FALSE;
+
+    pa_browser_ref(b);
+
+    while ((e = pa_hashmap_iterate(b->entries, &state, NULL)))
+        if (e->kind == kind && (e->provisional || e->stale) && !e->seen) {
+            withdraw(b, e);
+            changed = TRUE;
+        }
+
+    if (changed)
+        schedule_save(b);
+
+    release_cache_map(b);
+    pa_browser_unref(b);
+}
+
+static void free_entries(pa_browser *b) {
+    struct entry *e;
+
+    while ((e = pa_hashmap_first(b->entries)))
+        entry_free(e);
 }
 
+static void handle_failure(pa_browser *b);
+static void dispatch_resolvers(pa_browser *b);
+
 static void resolve_callback(
         AvahiServiceResolver *r,
         AvahiIfIndex interface,
@@ -98,29 +1453,34 @@ static void resolve_callback(
         AvahiLookupResultFlags flags,
         void *userdata) {
 
-    pa_browser *b = userdata;
+    struct service *s = userdata;
+    pa_browser *b;
     pa_browse_info i;
     char ip[256], a[256];
     int opcode;
-    int device_found = 0;
     uint32_t cookie;
     pa_sample_spec ss;
-    int ss_valid = 0;
-    char *key = NULL, *value = NULL;
+    struct txt_values v;
+    pa_bool_t found = FALSE, rejected = FALSE;
 
-    pa_assert(b);
+    pa_assert(s);
+    pa_assert(s->resolver == r);
+    pa_assert_se(b = s->browser);
     pa_assert(PA_REFCNT_VALUE(b) >= 1);
 
+    /* The callback might drop the last reference to us */
+    pa_browser_ref(b);
+
+    if (s->in_flight)
+        record_latency(b, PA_BROWSE_STAGE_RESOLVE, s->resolve_started_at);
+
     memset(&i, 0, sizeof(i));
     i.name = name;
 
     if (event != AVAHI_RESOLVER_FOUND)
         goto fail;
 
-    if (!b->callback)
-        goto fail;
-
-    opcode = map_to_opcode(type, 1);
+    opcode = map_to_opcode(s->type, 1);
     pa_assert(opcode >= 0);
 
     if (aa->proto == AVAHI_PROTO_INET)
@@ -131,101 +1491,167 @@ static void resolve_callback(
     }
     i.server = a;
 
+    parse_txt(txt, &v);
+
+    /* No device txt record was sent for a sink or source service */
+    if (opcode != PA_BROWSE_NEW_SERVER && !v.present[TXT_DEVICE])
+        goto fail;
+
+    if (v.present[TXT_DEVICE])
+        i.device = v.value[TXT_DEVICE];
+    if (v.present[TXT_SERVER_VERSION])
+        i.server_version = v.value[TXT_SERVER_VERSION];
+    if (v.present[TXT_USER_NAME])
+        i.user_name = v.value[TXT_USER_NAME];
+    if (v.present[TXT_DESCRIPTION])
+        i.description = v.value[TXT_DESCRIPTION];
 
-    while (txt) {
+    if (v.present[TXT_FQDN]) {
+        size_t l;
 
-        if (avahi_string_list_get_pair(txt, &key, &value, NULL) < 0)
-            break;
+        i.fqdn = v.value[TXT_FQDN];
 
-        if (!strcmp(key, "device")) {
-            device_found = 1;
-            pa_xfree((char*) i.device);
-            i.device = value;
-            value = NULL;
-        } else if (!strcmp(key, "server-version")) {
-            pa_xfree((char*) i.server_version);
-            i.server_version = value;
-            value = NULL;
-        } else if (!strcmp(key, "user-name")) {
-            pa_xfree((char*) i.user_name);
-            i.user_name = value;
-            value = NULL;
-        } else if (!strcmp(key, "fqdn")) {
-            size_t l;
+        l = strlen(a);
+        pa_assert(l+1 <= sizeof(a));
+        strncat(a, " ", sizeof(a)-l-1);
+        strncat(a, i.fqdn, sizeof(a)-l-2);
+    }
+
+    if (v.present[TXT_COOKIE]) {
+        if (atou(v.value[TXT_COOKIE], &cookie) < 0)
+            goto fail;
+
+        i.cookie = &cookie;
+    }
 
-            pa_xfree((char*) i.fqdn);
-            i.fqdn = value;
-            value = NULL;
+    if (v.present[TXT_CHANNELS]) {
+        uint32_t ch;
 
-            l = strlen(a);
-            pa_assert(l+1 <= sizeof(a));
-            strncat(a, " ", sizeof(a)-l-1);
-            strncat(a, i.fqdn, sizeof(a)-l-2);
-        } else if (!strcmp(key, "cookie")) {
+        if (atou(v.value[TXT_CHANNELS], &ch) < 0 || ch <= 0 || ch > 255)
+            goto fail;
 
-            if (atou(value, &cookie) < 0)
-                goto fail;
+        ss.channels = (uint8_t) ch;
+    }
+
+    if (v.present[TXT_RATE])
+        if (atou(v.value[TXT_RATE], &ss.rate) < 0)
+            goto fail;
 
-            i.cookie = &cookie;
-        } else if (!strcmp(key, "description")) {
-            pa_xfree((char*) i.description);
-            i.description = value;
-            value = NULL;
-        } else if (!strcmp(key, "channels")) {
-            uint32_t ch;
+    if (v.present[TXT_FORMAT])
+        if ((ss.format = pa_parse_sample_format(v.value[TXT_FORMAT])) == PA_SAMPLE_INVALID)
+            goto fail;
+
+    if (v.present[TXT_CHANNELS] && v.present[TXT_RATE] && v.present[TXT_FORMAT])
+        i.sample_spec = &ss;
 
-            if (atou(value, &ch) < 0 || ch <= 0 || ch > 255)
-                goto fail;
+    if (!filter_info(b, opcode, &i)) {
+        b->stats.filtered++;
+        rejected = TRUE;
+        goto fail;
+    }
 
-            ss.channels = (uint8_t) ch;
-            ss_valid |= 1;
+    entry_found(b, opcode, &i, &s->resolver_sighting);
+    found = TRUE;
 
-        } else if (!strcmp(key, "rate")) {
-            if (atou(value, &ss.rate) < 0)
-                goto fail;
-            ss_valid |= 2;
-        } else if (!strcmp(key, "format")) {
+fail:
+    if (found)
+        b->stats.resolves_found++;
+    else
+        b->stats.resolves_failed++;
 
-            if ((ss.format = pa_parse_sample_format(value)) == PA_SAMPLE_INVALID)
-                goto fail;
+    /* If the browser failed in the meantime, the service has already
+     * been freed */
+    if (b->client) {
+        struct entry *e;
+
+        /* A cached or unresolved service that cannot be resolved
+         * anymore is gone, and so is any service our filters reject */
+        if (!found &&
+            (e = entry_get(b, map_to_opcode(s->type, 1), s->name)) &&
+            (e->provisional || e->named_only || rejected)) {
+            withdraw(b, e);
+            schedule_save(b);
+            release_cache_map(b);
+        }
 
-            ss_valid |= 4;
+        /* The first result frees the slot, even if we keep the
+         * resolver around to learn about changes */
+        if (s->in_flight) {
+            pa_assert(b->n_resolvers >= 1);
+            b->n_resolvers--;
+            s->in_flight = FALSE;
         }
 
-        pa_xfree(key);
-        pa_xfree(value);
-        key = value = NULL;
+        if (found)
+            s->resolved = TRUE;
+
+        if (!found || !(b->flags & PA_BROWSE_TRACK_UPDATES))
+            service_cancel_resolver(s);
 
-        txt = avahi_string_list_get_next(txt);
+        dispatch_resolvers(b);
     }
 
-    /* No device txt record was sent for a sink or source service */
-    if (opcode != PA_BROWSE_NEW_SERVER && !device_found)
-        goto fail;
+    pa_browser_unref(b);
+}
 
-    if (ss_valid == 7)
-        i.sample_spec = &ss;
+/* Start queued resolves until we hit the concurrency limit */
+static void dispatch_resolvers(pa_browser *b) {
+    unsigned p;
 
-    b->callback(b, opcode, &i, b->userdata);
+    pa_assert(b);
+    pa_assert(b->client);
 
-fail:
-    pa_xfree((void*) i.device);
-    pa_xfree((void*) i.fqdn);
-    pa_xfree((void*) i.server_version);
-    pa_xfree((void*) i.user_name);
-    pa_xfree((void*) i.description);
+    for (p = 0; p < N_PRIORITIES && b->n_resolvers < b->max_resolvers; p++) {
+        struct service *s;
+
+        while (b->queue[p] && b->n_resolvers < b->max_resolvers) {
+            s = b->queue[p];
+            service_dequeue(s);
+
+            pa_assert(s->n_sightings > 0);
+            s->resolver_sighting = s->sightings[0];
+
+            if (!(s->resolver = avahi_service_resolver_new(
+                          b->client,
+                          s->resolver_sighting.interface,
+                          s->resolver_sighting.protocol,
+                          s->name,
+                          s->type,
+                          s->domain,
+                          AVAHI_PROTO_UNSPEC,
+                          0,
+                          resolve_callback,
+                          s))) {
+                handle_failure(b);
+                return;
+            }
 
-    pa_xfree(key);
-    pa_xfree(value);
+            s->in_flight = TRUE;
+            b->n_resolvers++;
 
-    avahi_service_resolver_free(r);
+            /* Refreshes wait for everything else on purpose */
+            if (p != PRIORITY_REFRESH)
+                record_latency(b, PA_BROWSE_STAGE_QUEUE, s->queued_at);
+            s->resolve_started_at = now_usec();
+
+            b->stats.resolves_started++;
+            if (b->n_resolvers > b->stats.peak_resolvers)
+                b->stats.peak_resolvers = b->n_resolvers;
+        }
+    }
 }
 
-static void handle_failure(pa_browser *b) {
-    const char *e = NULL;
+/* Drop everything that depends on the connection to the daemon, but
+ * keep the entries around. They are confirmed or evicted once we are
+ * browsing again, so that our user sees no change for services that
+ * are still there. */
+static void stop_browsing(pa_browser *b) {
+    struct entry *e;
+    void *state = NULL;
 
     pa_assert(b);
-    pa_assert(PA_REFCNT_VALUE(b) >= 1);
+
+    free_services(b);
 
     if (b->sink_browser)
         avahi_service_browser_free(b->sink_browser);
@@ -236,6 +1662,42 @@ static void handle_failure(pa_browser *b) {
 
     b->sink_browser = b->source_browser = b->server_browser = NULL;
 
+    while ((e = pa_hashmap_iterate(b->entries, &state, NULL))) {
+        if (!e->provisional)
+            e->stale = TRUE;
+
+        e->seen = FALSE;
+    }
+
+    b->reconnecting = TRUE;
+}
+
+static void reconnect_event_cb(pa_mainloop_api *m, pa_time_event *e, const struct timeval *tv, void *userdata);
+
+static void schedule_reconnect(pa_browser *b) {
+    struct timeval tv;
+
+    pa_assert(b);
+
+    b->reconnect_delay = b->reconnect_delay > 0 ? PA_MIN(b->reconnect_delay * 2, RECONNECT_MAX_USEC) : RECONNECT_MIN_USEC;
+
+    pa_gettimeofday(&tv);
+    pa_timeval_add(&tv, b->reconnect_delay);
+
+    if (b->reconnect_event)
+        b->mainloop->time_restart(b->reconnect_event, &tv);
+    else
+        b->reconnect_event = b->mainloop->time_new(b->mainloop, &tv, reconnect_event_cb, b);
+}
+
+static void handle_failure(pa_browser *b) {
+    const char *e = NULL;
+
+    pa_assert(b);
+    pa_assert(PA_REFCNT_VALUE(b) >= 1);
+
+    stop_browsing(b);
+
     if (b->client) {
         e = avahi_strerror(avahi_client_errno(b->client));
         avahi_client_free(b->client);
@@ -243,6 +1705,8 @@ static void handle_failure(pa_browser *b) {
 
     b->client = NULL;
 
+    schedule_reconnect(b);
+
     if (b->error_callback)
         b->error_callback(b, e, b->error_userdata);
 }
@@ -263,42 +1727,105 @@ static void browse_callback(
     pa_assert(b);
     pa_assert(PA_REFCNT_VALUE(b) >= 1);
 
+    b->stats.browse_events++;
+
     switch (event) {
         case AVAHI_BROWSER_NEW: {
+            struct service *s;
+            struct entry *e;
+            pa_bool_t known = FALSE, refresh = FALSE;
+
+            /* Not interesting enough to even look at it */
+            if (!filter_match(b, map_to_opcode(type, 1), PA_BROWSE_FILTER_NAME, name)) {
+                b->stats.filtered++;
+                break;
+            }
 
-            if (!avahi_service_resolver_new(
-                          b->client,
-                          interface,
-                          protocol,
-                          name,
-                          type,
-                          domain,
-                          AVAHI_PROTO_UNSPEC,
-                          0,
-                          resolve_callback,
-                          b))
-                handle_failure(b);
+            if ((e = entry_get(b, map_to_opcode(type, 1), name))) {
+                e->seen = TRUE;
+
+                /* We resolved it before we lost the connection to the
+                 * daemon, no need to do that again. If we track
+                 * updates we need a resolver for it, but one that
+                 * reports what we already know can wait until the
+                 * services that really need resolving are done. Only
+                 * a service that came back elsewhere may have
+                 * changed. */
+                if (e->stale && !e->named_only) {
+                    if (!(b->flags & PA_BROWSE_TRACK_UPDATES))
+                        known = TRUE;
+                    else if (e->resolved_on.interface == interface &&
+                             e->resolved_on.protocol == protocol)
+                        refresh = TRUE;
+                }
+
+                e->stale = FALSE;
+            }
+
+            /* Just another interface or protocol for a service we
+             * already know */
+            if ((s = service_get(b, name, type, domain))) {
+                service_add_sighting(s, interface, protocol);
+                break;
+            }
+
+            s = service_new(b, interface, protocol, name, type, domain);
+
+            if (known)
+                s->resolved = TRUE;
+            else if (refresh) {
+                s->resolved = TRUE;
+                s->priority = PRIORITY_REFRESH;
+                service_enqueue(s);
+                dispatch_resolvers(b);
+            } else if (b->resolve_flags & kind_flag(map_to_opcode(type, 1))) {
+                service_enqueue(s);
+                dispatch_resolvers(b);
+            } else if (!e)
+                entry_named(b, map_to_opcode(type, 1), name);
 
             break;
         }
 
         case AVAHI_BROWSER_REMOVE: {
+            struct service *s;
+            struct entry *e;
+
+            if (!(s = service_get(b, name, type, domain)) ||
+                !service_remove_sighting(s, interface, protocol))
+                break;
+
+            if (s->n_sightings > 0) {
+
+                /* Still visible elsewhere, but we might need to
+                 * resolve it through one of the other sightings */
+                if (s->resolver &&
+                    s->resolver_sighting.interface == interface &&
+                    s->resolver_sighting.protocol == protocol) {
+                    service_cancel_resolver(s);
+                    service_enqueue(s);
+                    dispatch_resolvers(b);
+                }
+
+                break;
+            }
 
-            if (b->callback) {
-                pa_browse_info i;
-                int opcode;
-
-                memset(&i, 0, sizeof(i));
-                i.name = name;
-
-                opcode = map_to_opcode(type, 0);
-                pa_assert(opcode >= 0);
+            service_free(s);
+            dispatch_resolvers(b);
 
-                b->callback(b, opcode, &i, b->userdata);
+            if (b->client && (e = entry_get(b, map_to_opcode(type, 1), name))) {
+                withdraw(b, e);
+                schedule_save(b);
+                release_cache_map(b);
             }
+
             break;
         }
 
+        case AVAHI_BROWSER_ALL_FOR_NOW:
+            sweep_provisional(b, map_to_opcode(type, 1));
+            break;
+
         case AVAHI_BROWSER_FAILURE: {
             handle_failure(b);
             break;
@@ -309,6 +1836,61 @@ static void browse_callback(
     }
 }
 
+/* Create the service browsers for the kinds of services we are
+ * interested in */
+static int start_browsing(pa_browser *b, const char **error_string) {
+
+    pa_assert(b);
+    pa_assert(b->client);
+
+    if ((b->flags & PA_BROWSE_FOR_SERVERS) &&
+        !(b->server_browser = avahi_service_browser_new(
+                  b->client,
+                  AVAHI_IF_UNSPEC,
+                  AVAHI_PROTO_INET,
+                  SERVICE_TYPE_SERVER,
+                  NULL,
+                  0,
+                  browse_callback,
+                  b)))
+        goto fail;
+
+    if ((b->flags & PA_BROWSE_FOR_SINKS) &&
+        !(b->sink_browser = avahi_service_browser_new(
+                  b->client,
+                  AVAHI_IF_UNSPEC,
+                  AVAHI_PROTO_UNSPEC,
+                  SERVICE_TYPE_SINK,
+                  NULL,
+                  0,
+                  browse_callback,
+                  b)))
+        goto fail;
+
+    if ((b->flags & PA_BROWSE_FOR_SOURCES) &&
+        !(b->source_browser = avahi_service_browser_new(
+                  b->client,
+                  AVAHI_IF_UNSPEC,
+                  AVAHI_PROTO_UNSPEC,
+                  SERVICE_TYPE_SOURCE,
+                  NULL,
+                  0,
+                  browse_callback,
+                  b)))
+        goto fail;
+
+    b->reconnecting = FALSE;
+    b->reconnect_delay = 0;
+
+    return 0;
+
+fail:
+    if (error_string)
+        *error_string = avahi_strerror(avahi_client_errno(b->client));
+
+    return -1;
+}
+
 static void client_callback(AvahiClient *s, AvahiClientState state, void *userdata) {
     pa_browser *b = userdata;
 
@@ -316,24 +1898,68 @@ static void client_callback(AvahiClient *s, AvahiClientState state, void *userda
     pa_assert(b);
     pa_assert(PA_REFCNT_VALUE(b) >= 1);
 
-    if (state == AVAHI_CLIENT_FAILURE)
-        handle_failure(b);
+    switch (state) {
+        case AVAHI_CLIENT_S_RUNNING:
+            /* The daemon is back. If we are still inside
+             * avahi_client_new(), reconnect_event_cb() takes care of
+             * this. */
+            if (b->reconnecting && b->client)
+                if (start_browsing(b, NULL) < 0)
+                    handle_failure(b);
+            break;
+
+        case AVAHI_CLIENT_CONNECTING:
+            /* The daemon went away. With AVAHI_CLIENT_NO_FAIL the client
+             * waits for it to come back on its own. */
+            if (!b->reconnecting)
+                stop_browsing(b);
+            break;
+
+        case AVAHI_CLIENT_FAILURE:
+            handle_failure(b);
+            break;
+
+        default:
+            ;
+    }
+}
+
+static void reconnect_event_cb(pa_mainloop_api *m, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    pa_browser *b = userdata;
+    int error;
+
+    pa_assert(b);
+    pa_assert(!b->client);
+
+    m->time_restart(e, NULL);
+
+    if (!(b->client = avahi_client_new(b->avahi_poll, AVAHI_CLIENT_NO_FAIL, client_callback, b, &error))) {
+        pa_log_debug("Failed to reconnect to Avahi: %s", avahi_strerror(error));
+        schedule_reconnect(b);
+        return;
+    }
+
+    if (avahi_client_get_state(b->client) == AVAHI_CLIENT_S_RUNNING)
+        if (start_browsing(b, NULL) < 0)
+            handle_failure(b);
 }
 
 static void browser_free(pa_browser *b);
 
 
 pa_browser *pa_browser_new(pa_mainloop_api *mainloop) {
-    return pa_browser_new_full(mainloop, PA_BROWSE_FOR_SERVERS|PA_BROWSE_FOR_SINKS|PA_BROWSE_FOR_SOURCES, NULL);
+    return pa_browser_new_full(mainloop, PA_BROWSE_FOR_SERVERS|PA_BROWSE_FOR_SINKS|PA_BROWSE_FOR_SOURCES, 0, NULL);
 }
 
-pa_browser *pa_browser_new_full(pa_mainloop_api *mainloop, pa_browse_flags_t flags, const char **error_string) {
+pa_browser *pa_browser_new_full(pa_mainloop_api *mainloop, pa_browse_flags_t flags, unsigned max_resolvers, const char **error_string) {
     pa_browser *b;
     int error;
+    unsigned p;
 
     pa_assert(mainloop);
 
-    if (flags & ~(PA_BROWSE_FOR_SERVERS|PA_BROWSE_FOR_SINKS|PA_BROWSE_FOR_SOURCES) || flags == 0)
+    if (flags & ~(PA_BROWSE_FOR_SERVERS|PA_BROWSE_FOR_SINKS|PA_BROWSE_FOR_SOURCES|PA_BROWSE_TRACK_UPDATES|PA_BROWSE_LAZY_RESOLVE) ||
+        !(flags & (PA_BROWSE_FOR_SERVERS|PA_BROWSE_FOR_SINKS|PA_BROWSE_FOR_SOURCES)))
         return NULL;
 
     b = pa_xnew(pa_browser, 1);
@@ -344,62 +1970,60 @@ pa_browser *pa_browser_new_full(pa_mainloop_api *mainloop, pa_browse_flags_t fla
     b->error_callback = NULL;
     b->error_userdata = NULL;
     b->sink_browser = b->source_browser = b->server_browser = NULL;
-
-    b->avahi_poll = pa_avahi_poll_new(mainloop);
-
-    if (!(b->client = avahi_client_new(b->avahi_poll, 0, client_callback, b, &error))) {
-        if (error_string)
-            *error_string = avahi_strerror(error);
-        goto fail;
+    b->reconnecting = FALSE;
+    b->reconnect_event = NULL;
+    b->reconnect_delay = 0;
+
+    b->services = pa_hashmap_new(service_hash_func, service_compare_func);
+    for (p = 0; p < N_PRIORITIES; p++) {
+        PA_LLIST_HEAD_INIT(struct service, b->queue[p]);
+        b->queue_tail[p] = NULL;
     }
+    b->n_resolvers = 0;
+    b->max_resolvers = max_resolvers > 0 ? max_resolvers : DEFAULT_MAX_RESOLVERS;
+
+    b->flags = flags;
+    b->resolve_flags = (flags & PA_BROWSE_LAZY_RESOLVE) ? 0 : (flags & (PA_BROWSE_FOR_SERVERS|PA_BROWSE_FOR_SINKS|PA_BROWSE_FOR_SOURCES));
+    b->entries = pa_hashmap_new(entry_hash_func, entry_compare_func);
+    PA_LLIST_HEAD_INIT(struct filter, b->filters);
+    b->cache_file = NULL;
+    b->cache_map = NULL;
+    b->cache_map_size = 0;
+    b->n_borrowed = 0;
+    b->announce_event = NULL;
+    b->save_event = NULL;
+    b->save_pending = FALSE;
+
+    b->batch_callback = NULL;
+    b->batch_userdata = NULL;
+    b->batch_window = 0;
+    b->pending_events = pa_hashmap_new(pending_event_hash_func, pending_event_compare_func);
+    PA_LLIST_HEAD_INIT(struct pending_event, b->pending_head);
+    b->pending_tail = NULL;
+    b->batch_defer_event = NULL;
+    b->batch_time_event = NULL;
+    b->batch_armed = FALSE;
+    b->batch_buffer = NULL;
+    b->batch_buffer_size = 0;
+
+    memset(&b->stats, 0, sizeof(b->stats));
 
-    if ((flags & PA_BROWSE_FOR_SERVERS) &&
-        !(b->server_browser = avahi_service_browser_new(
-                  b->client,
-                  AVAHI_IF_UNSPEC,
-                  AVAHI_PROTO_INET,
-                  SERVICE_TYPE_SERVER,
-                  NULL,
-                  0,
-                  browse_callback,
-                  b))) {
-
-        if (error_string)
-            *error_string = avahi_strerror(avahi_client_errno(b->client));
-        goto fail;
-    }
+    b->avahi_poll = pa_avahi_poll_new(mainloop);
 
-    if ((flags & PA_BROWSE_FOR_SINKS) &&
-        !(b->sink_browser = avahi_service_browser_new(
-                  b->client,
-                  AVAHI_IF_UNSPEC,
-                  AVAHI_PROTO_UNSPEC,
-                  SERVICE_TYPE_SINK,
-                  NULL,
-                  0,
-                  browse_callback,
-                  b))) {
+    /* A daemon that isn't running yet is treated like one that went
+     * away later on: we wait for it to come up, and in the meantime
+     * the cache file tells our user what was there last time */
+    b->reconnecting = TRUE;
 
-        if (error_string)
-            *error_string = avahi_strerror(avahi_client_errno(b->client));
-        goto fail;
+    if (!(b->client = avahi_client_new(b->avahi_poll, AVAHI_CLIENT_NO_FAIL, client_callback, b, &error))) {
+        pa_log_debug("Failed to connect to Avahi: %s", avahi_strerror(error));
+        schedule_reconnect(b);
+        return b;
     }
 
-    if ((flags & PA_BROWSE_FOR_SOURCES) &&
-        !(b->source_browser = avahi_service_browser_new(
-                  b->client,
-                  AVAHI_IF_UNSPEC,
-                  AVAHI_PROTO_UNSPEC,
-                  SERVICE_TYPE_SOURCE,
-                  NULL,
-                  0,
-                  browse_callback,
-                  b))) {
-
-        if (error_string)
-            *error_string = avahi_strerror(avahi_client_errno(b->client));
-        goto fail;
-    }
+    if (avahi_client_get_state(b->client) == AVAHI_CLIENT_S_RUNNING)
+        if (start_browsing(b, error_string) < 0)
+            goto fail;
 
     return b;
 
@@ -414,6 +2038,42 @@ static void browser_free(pa_browser *b) {
     pa_assert(b);
     pa_assert(b->mainloop);
 
+    free_services(b);
+    pa_hashmap_free(b->services, NULL, NULL);
+
+    if (b->save_pending)
+        save_cache(b);
+
+    if (b->save_event)
+        b->mainloop->time_free(b->save_event);
+    if (b->reconnect_event)
+        b->mainloop->time_free(b->reconnect_event);
+    if (b->announce_event)
+        b->mainloop->defer_free(b->announce_event);
+
+    while (b->pending_head)
+        pending_event_free(b, b->pending_head);
+    pa_hashmap_free(b->pending_events, NULL, NULL);
+    pa_xfree(b->batch_buffer);
+
+    if (b->batch_defer_event)
+        b->mainloop->defer_free(b->batch_defer_event);
+    if (b->batch_time_event)
+        b->mainloop->time_free(b->batch_time_event);
+
+    free_entries(b);
+    pa_hashmap_free(b->entries, NULL, NULL);
+
+    while (b->filters) {
+        struct filter *f = b->filters;
+
+        PA_LLIST_REMOVE(struct filter, b->filters, f);
+        pa_xfree(f->pattern);
+        pa_xfree(f);
+    }
+    release_cache_map(b);
+    pa_xfree(b->cache_file);
+
     if (b->sink_browser)
         avahi_service_browser_free(b->sink_browser);
     if (b->source_browser)
@@ -461,3 +2121,140 @@ void pa_browser_set_error_callback(pa_browser *b, pa_browser_error_cb_t cb, void
     b->error_callback = cb;
     b->error_userdata = userdata;
 }
+
+void pa_browser_set_cache_file(pa_browser *b, const char *fn) {
+    pa_assert(b);
+    pa_assert(PA_REFCNT_VALUE(b) >= 1);
+    pa_assert(fn);
+    pa_assert(!b->cache_file);
+
+    b->cache_file = pa_xstrdup(fn);
+    load_cache(b);
+
+    if (pa_hashmap_isempty(b->entries))
+        return;
+
+    b->announce_event = b->mainloop->defer_new(b->mainloop, announce_event_cb, b);
+}
+
+void pa_browser_set_batch_callback(pa_browser *b, pa_browse_batch_cb_t cb, pa_usec_t window, void *userdata) {
+    pa_assert(b);
+    pa_assert(PA_REFCNT_VALUE(b) >= 1);
+
+    /* Deliver whatever is still queued to the old callback */
+    flush_events(b);
+
+    b->batch_callback = cb;
+    b->batch_userdata = userdata;
+    b->batch_window = window;
+
+    if (!b->batch_defer_event) {
+        b->batch_defer_event = b->mainloop->defer_new(b->mainloop, batch_defer_event_cb, b);
+        b->mainloop->defer_enable(b->batch_defer_event, 0);
+    }
+}
+
+void pa_browser_resolve(pa_browser *b, pa_browse_flags_t flags) {
+    struct service *s;
+    void *state = NULL;
+
+    pa_assert(b);
+    pa_assert(PA_REFCNT_VALUE(b) >= 1);
+
+    flags &= b->flags & (PA_BROWSE_FOR_SERVERS|PA_BROWSE_FOR_SINKS|PA_BROWSE_FOR_SOURCES);
+
+    if (!(flags & ~b->resolve_flags))
+        return;
+
+    b->resolve_flags |= flags;
+
+    if (!b->client)
+        return;
+
+    while ((s = pa_hashmap_iterate(b->services, &state, NULL)))
+        if (!s->resolved && !s->queued && !s->resolver &&
+            (flags & kind_flag(map_to_opcode(s->type, 1))))
+            service_enqueue(s);
+
+    dispatch_resolvers(b);
+}
+
+void pa_browser_get_stats(pa_browser *b, pa_browser_stats *stats) {
+    pa_assert(b);
+    pa_assert(PA_REFCNT_VALUE(b) >= 1);
+    pa_assert(stats);
+
+    *stats = b->stats;
+    stats->n_services = pa_hashmap_size(b->services);
+    stats->n_entries = pa_hashmap_size(b->entries);
+
+    if (b->avahi_poll) {
+        pa_avahi_poll_stats ps;
+
+        pa_avahi_poll_get_stats(b->avahi_poll, &ps);
+        stats->timer_wakeups = ps.wakeups;
+        stats->timeout_callbacks = ps.timeout_callbacks;
+        stats->watch_callbacks = ps.watch_callbacks;
+        stats->avahi_objects = ps.n_watch_objects + ps.n_timeout_objects;
+        stats->peak_avahi_objects = ps.peak_watch_objects + ps.peak_timeout_objects;
+        stats->avahi_slabs = ps.n_slabs;
+    }
+}
+
+void pa_browser_set_timer_slack(pa_browser *b, pa_usec_t slack) {
+    pa_assert(b);
+    pa_assert(PA_REFCNT_VALUE(b) >= 1);
+
+    pa_avahi_poll_set_slack(b->avahi_poll, slack);
+}
+
+void pa_browse_histogram_add(pa_browse_histogram *h, pa_usec_t usec) {
+    unsigned k = 0;
+    pa_usec_t u;
+
+    pa_assert(h);
+
+    for (u = usec; u > 0 && k < PA_BROWSE_HISTOGRAM_BUCKETS-1; u >>= 1)
+        k++;
+
+    h->bucket[k]++;
+    h->count++;
+    h->sum += usec;
+
+    if (usec > h->max)
+        h->max = usec;
+}
+
+pa_usec_t pa_browse_histogram_percentile(const pa_browse_histogram *h, unsigned percent) {
+    uint64_t n, seen = 0;
+    unsigned k;
+
+    pa_assert(h);
+    pa_assert(percent <= 100);
+
+    if (h->count <= 0)
+        return 0;
+
+    n = (h->count * percent + 99) / 100;
+
+    for (k = 0; k < PA_BROWSE_HISTOGRAM_BUCKETS-1; k++)
+        if ((seen += h->bucket[k]) >= n && seen > 0)
+            return PA_MIN((pa_usec_t) 1 << k, h->max);
+
+    return h->max;
+}
+
+void pa_browser_add_filter(pa_browser *b, pa_browse_flags_t kinds, pa_browse_filter_field_t field, const char *pattern) {
+    struct filter *f;
+
+    pa_assert(b);
+    pa_assert(PA_REFCNT_VALUE(b) >= 1);
+    pa_assert(field < PA_BROWSE_FILTER_MAX);
+    pa_assert(pattern);
+
+    f = pa_xnew(struct filter, 1);
+    f->kinds = kinds & (PA_BROWSE_FOR_SERVERS|PA_BROWSE_FOR_SINKS|PA_BROWSE_FOR_SOURCES);
+    f->field = field;
+    f->pattern = pa_xstrdup(pattern);
+    PA_LLIST_PREPEND(struct filter, b->filters, f);
+}
@@ -43,20 +43,30 @@ typedef enum pa_browse_opcode {
     PA_BROWSE_NEW_SOURCE,     /**< New source found */
     PA_BROWSE_REMOVE_SERVER,  /**< Server disappeared */
     PA_BROWSE_REMOVE_SINK,    /**< Sink disappeared */
-    PA_BROWSE_REMOVE_SOURCE   /**< Source disappeared */
+    PA_BROWSE_REMOVE_SOURCE,  /**< Source disappeared */
+    PA_BROWSE_UPDATE_SERVER,  /**< Information about a server changed, only with PA_BROWSE_TRACK_UPDATES */
+    PA_BROWSE_UPDATE_SINK,    /**< Information about a sink changed, only with PA_BROWSE_TRACK_UPDATES */
+    PA_BROWSE_UPDATE_SOURCE   /**< Information about a source changed, only with PA_BROWSE_TRACK_UPDATES */
 } pa_browse_opcode_t;
 
 typedef enum pa_browse_flags {
     PA_BROWSE_FOR_SERVERS = 1, /**< Browse for servers */
     PA_BROWSE_FOR_SINKS = 2, /**< Browse for sinks */
-    PA_BROWSE_FOR_SOURCES = 4 /** Browse for sources */
+    PA_BROWSE_FOR_SOURCES = 4, /**< Browse for sources */
+    PA_BROWSE_TRACK_UPDATES = 8, /**< Keep resolving services after they have been found, and report changes with PA_BROWSE_UPDATE_xxx events */
+    PA_BROWSE_LAZY_RESOLVE = 16 /**< Report services by name only and resolve them only after pa_browser_resolve() has been called for their kind */
 } pa_browse_flags_t;
 
 /** Create a new browser object on the specified main loop */
 pa_browser *pa_browser_new(pa_mainloop_api *mainloop);
 
-/** Same pa_browser_new, but pass additional flags parameter. */
-pa_browser *pa_browser_new_full(pa_mainloop_api *mainloop, pa_browse_flags_t flags, const char **error_string);
+/** Same pa_browser_new, but pass additional flags parameter and the
+ * maximum number of service resolvers that may run concurrently. Services
+ * discovered beyond that limit are queued and resolved as earlier
+ * resolves complete. Pass 0 for the default limit. If the Avahi daemon
+ * is not running, the browser object is created anyway and starts
+ * browsing once the daemon is up, see pa_browser_set_error_callback(). */
+pa_browser *pa_browser_new_full(pa_mainloop_api *mainloop, pa_browse_flags_t flags, unsigned max_resolvers, const char **error_string);
 
 /** Increase reference counter of the specified browser object */
 pa_browser *pa_browser_ref(pa_browser *z);
@@ -68,7 +78,7 @@ void pa_browser_unref(pa_browser *z);
 typedef struct pa_browse_info {
     const char *name;  /**< Unique service name; always available */
 
-    const char *server; /**< Server name; always available */
+    const char *server; /**< Server name; always available, except for services that have not been resolved yet with PA_BROWSE_LAZY_RESOLVE */
     const char *server_version; /**< Server version string; optional */
     const char *user_name; /**< User name of the server process; optional */
     const char *fqdn; /* Server version; optional */
@@ -85,15 +95,128 @@ typedef void (*pa_browse_cb_t)(pa_browser *z, pa_browse_opcode_t c, const pa_bro
 /** Set the callback pointer for the browser object */
 void pa_browser_set_callback(pa_browser *z, pa_browse_cb_t cb, void *userdata);
 
+/** A single event as delivered to a pa_browse_batch_cb_t callback */
+typedef struct pa_browse_event {
+    pa_browse_opcode_t opcode; /**< What happened */
+    pa_browse_info info;       /**< The service it happened to. For removals only the name is set */
+} pa_browse_event;
+
+/** Callback prototype for batched events */
+typedef void (*pa_browse_batch_cb_t)(pa_browser *z, const pa_browse_event *events, unsigned n, void *userdata);
+
+/** Set a callback that receives all events collected during one main
+ * loop iteration (if window is 0) or during the specified time window
+ * in a single call. Services that appear and disappear again within
+ * the same batch are not reported at all, and there is at most one
+ * event per service in each batch. A known service that disappears and
+ * comes back is reported as updated if PA_BROWSE_TRACK_UPDATES is set;
+ * otherwise the batch ends early, so that its removal is delivered
+ * before it is announced again. A service is never reported as new
+ * twice without a removal in between. While a batch callback is set,
+ * the callback set with pa_browser_set_callback() is not called. */
+void pa_browser_set_batch_callback(pa_browser *z, pa_browse_batch_cb_t cb, pa_usec_t window, void *userdata);
+
 /** Callback prototype for errors */
 typedef void (*pa_browser_error_cb_t)(pa_browser *z, const char *error_string, void *userdata);
 
 /** Set a callback function that is called whenever the browser object
- * becomes invalid due to an error. After this function has been
- * called the browser object has become invalid and should be
- * freed. */
+ * loses its connection to the Avahi daemon. The browser object stays
+ * valid: it keeps the services it knows about and reconnects on its
+ * own, with increasing delays between the attempts. Once it is
+ * browsing again, only the services that really disappeared in the
+ * meantime are reported as removed. */
 void pa_browser_set_error_callback(pa_browser *z, pa_browser_error_cb_t, void *userdata);
 
+/** Start resolving all services of the kinds specified by the
+ * PA_BROWSE_FOR_xxx flags, the ones found so far and all that are
+ * found later on. Only useful with PA_BROWSE_LAZY_RESOLVE, where
+ * services are reported with just their name until then, followed by
+ * a PA_BROWSE_UPDATE_xxx event once they are resolved. */
+void pa_browser_resolve(pa_browser *z, pa_browse_flags_t flags);
+
+/** The fields of a service filters can be applied to */
+typedef enum pa_browse_filter_field {
+    PA_BROWSE_FILTER_NAME,        /**< The service name. Checked before the service is resolved */
+    PA_BROWSE_FILTER_SERVER,      /**< The server string as in pa_browse_info */
+    PA_BROWSE_FILTER_FQDN,        /**< The fully qualified domain name of the server */
+    PA_BROWSE_FILTER_DEVICE,      /**< The device name */
+    PA_BROWSE_FILTER_SAMPLE_SPEC, /**< The sample specification as formatted by pa_sample_spec_snprint() */
+    PA_BROWSE_FILTER_MAX
+} pa_browse_filter_field_t;
+
+/** Only report services of the kinds specified by the PA_BROWSE_FOR_xxx
+ * flags whose field matches the shell wildcard pattern (see
+ * fnmatch(3)). If several filters apply to the same field, a service
+ * has to match one of them. If filters apply to several fields, it has
+ * to match on all of them. A missing field matches nothing. Services
+ * that fail a name filter are never resolved. Call this directly after
+ * creating the browser object, before pa_browser_set_cache_file(). */
+void pa_browser_add_filter(pa_browser *z, pa_browse_flags_t kinds, pa_browse_filter_field_t field, const char *pattern);
+
+/** Keep a copy of all resolved services in the specified file. If
+ * the file already exists, the services stored in it are reported to
+ * the callback right away on the next main loop iteration, before
+ * live discovery has even started. These provisional entries are
+ * removed again if live discovery does not find them. Call this only
+ * once, directly after creating the browser object. */
+void pa_browser_set_cache_file(pa_browser *z, const char *fn);
+
+#define PA_BROWSE_HISTOGRAM_BUCKETS 32
+
+/** A latency histogram with logarithmic buckets. Bucket 0 counts
+ * latencies of 0 usec, bucket k latencies of at least 2^(k-1) and
+ * less than 2^k usec. The last bucket takes everything beyond. */
+typedef struct pa_browse_histogram {
+    uint32_t bucket[PA_BROWSE_HISTOGRAM_BUCKETS];
+    uint64_t count;  /**< Number of samples */
+    pa_usec_t sum;   /**< Sum of all samples, for the mean */
+    pa_usec_t max;   /**< Largest sample */
+} pa_browse_histogram;
+
+/** Add a sample to a histogram */
+void pa_browse_histogram_add(pa_browse_histogram *h, pa_usec_t usec);
+
+/** Return an upper bound for the specified percentile of the
+ * samples in the histogram */
+pa_usec_t pa_browse_histogram_percentile(const pa_browse_histogram *h, unsigned percent);
+
+/** The stages a service passes through before our user learns about it */
+typedef enum pa_browse_stage {
+    PA_BROWSE_STAGE_QUEUE,   /**< From being queued for resolving until the resolver is started */
+    PA_BROWSE_STAGE_RESOLVE, /**< From starting the resolver until its first result */
+    PA_BROWSE_STAGE_DELIVER, /**< From being resolved until the event reaches the callback */
+    PA_BROWSE_STAGE_MAX
+} pa_browse_stage_t;
+
+/** Counters of the work a browser object has done since it was
+ * created. Meant for profiling and benchmarking. */
+typedef struct pa_browser_stats {
+    uint64_t browse_events;    /**< Events received from the Avahi service browsers */
+    uint64_t resolves_started; /**< Service resolvers started */
+    uint64_t resolves_found;   /**< Resolver results that were usable */
+    uint64_t resolves_failed;  /**< Resolver results that were not */
+    uint64_t filtered;         /**< Services dropped by a filter */
+    uint64_t callbacks;        /**< Calls of the event or batch callback */
+    uint64_t events_delivered; /**< Events passed to these callbacks */
+    unsigned peak_resolvers;   /**< Highest number of resolvers in flight at the same time */
+    unsigned n_services;       /**< Services currently visible */
+    unsigned n_entries;        /**< Services currently known to the user */
+    uint64_t timer_wakeups;     /**< Wakeups of the timer that drives all Avahi timeouts */
+    uint64_t timeout_callbacks; /**< Avahi timeouts dispatched */
+    uint64_t watch_callbacks;   /**< Avahi I/O watches dispatched */
+    unsigned avahi_objects;      /**< Avahi watches and timeouts currently allocated */
+    unsigned peak_avahi_objects; /**< Peak number of watches plus peak number of timeouts */
+    unsigned avahi_slabs;        /**< Slabs these objects are carved from */
+    pa_browse_histogram latency[PA_BROWSE_STAGE_MAX]; /**< How long services spent in each stage */
+} pa_browser_stats;
+
+/** Fill in the current counters of the browser object */
+void pa_browser_get_stats(pa_browser *z, pa_browser_stats *stats);
+
+/** Allow Avahi timeouts to fire up to slack usecs late, so that
+ * timeouts close to each other share a single wakeup */
+void pa_browser_set_timer_slack(pa_browser *z, pa_usec_t slack);
+
 PA_C_DECL_END
 
 #endif
@@ -23,12 +23,14 @@
 
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include <gtk/gtk.h>
 #include <gdk/gdkx.h>
+#include <gdk/gdkkeysyms.h>
 #include <glade/glade.h>
 #include <gconf/gconf-client.h>
 #include <libgnome/gnome-desktop-item.h>
@@ -38,34 +40,207 @@
 #include <pulse/pulseaudio.h>
 #include <pulse/glib-mainloop.h>
 
+#include <pulsecore/atomic.h>
+#include <pulsecore/spscq.h>
+
 #include "x11prop.h"
 #include "browser.h"
+#include "prober.h"
 
 #define GCONF_PREFIX "/apps/padevchooser"
 
+/* Discovery events are handed to us in batches of this many usecs */
+#define BROWSE_BATCH_WINDOW_USEC (50*PA_USEC_PER_MSEC)
+
+/* How many batches may be on their way from the browser thread to the
+ * UI, and how long the browser thread waits before trying again when
+ * the UI is that far behind */
+#define BROWSE_QUEUE_SIZE 256
+
+/* Avahi timeouts may fire this late, so that they can share wakeups */
+#define BROWSE_TIMER_SLACK_USEC (50*PA_USEC_PER_MSEC)
+#define BROWSE_RETRY_USEC (20*PA_USEC_PER_MSEC)
+
+/* Servers are checked for reachability this many at a time, given up
+ * on after the timeout, and checked again after the interval */
+#define PROBE_MAX_CONCURRENT 8
+#define PROBE_TIMEOUT_USEC (2*PA_USEC_PER_SEC)
+#define PROBE_INTERVAL_USEC (60*PA_USEC_PER_SEC)
+
+/* Round trip times closer than this are considered equal when ranking
+ * menu items, so that jitter doesn't shuffle the menus around */
+#define RANK_RTT_GRANULARITY_USEC (1*PA_USEC_PER_MSEC)
+
+/* What depends on the whole set of items is refreshed when idle, after
+ * redrawing */
+#define MENU_REFRESH_PRIORITY (GDK_PRIORITY_REDRAW+10)
+
+/* Items shown per page of a submenu, the rest is behind "More..." */
+#define MENU_PAGE_SIZE 40
+
+/* Matches listed in the search window at most */
+#define SEARCH_MAX_RESULTS 200
+
+/* The notification lists this many of the latest events at most, and
+ * is updated at most once per interval */
+#define NOTIFY_RING_SIZE 8
+#define NOTIFY_INTERVAL_MSEC 1000
+
+/* A batch of discovery events copied into a single block, followed
+ * by the cookies, sample specs and strings the events point to */
+struct browse_batch {
+    pa_usec_t queued_at;
+    unsigned n;
+    pa_browse_event events[];
+};
+
+/* The widgets for the discovered items on a host. They exist only
+ * while the host's submenu is shown, and only page by page: the
+ * submenu itself is the first page, and each page ends with a
+ * "More..." item that has the next page as its submenu. */
+struct menu_window {
+    GtkMenu *menu;
+    GSequence *ranking;
+    GCallback callback;
+
+    /* Items that currently have a widget */
+    GQueue *built;
+
+    /* pages->pdata[0] is menu, more_items->pdata[k] leads from page k
+     * to page k+1. Pages are built in order as they are shown. */
+    GPtrArray *pages, *more_items;
+    guint n_built_pages;
+
+    gboolean shown, dirty;
+    guint release_source;
+};
+
+/* The discovered items of a submenu, grouped by the host they are on.
+ * The submenu lists the hosts only, each with the items on it in a
+ * menu_window of its own. */
+struct menu_hosts {
+    GtkMenu *menu;
+    GCallback callback;
+
+    GHashTable *hosts;
+    GSequence *order;
+};
+
+struct menu_host {
+    struct menu_hosts *hosts;
+
+    /* The fqdn, or the server cookie if there is none */
+    gchar *key, *label;
+    GSequenceIter *order;
+
+    GtkWidget *menu_item;
+    struct menu_window window;
+    guint n_items;
+};
+
+/* A word of the name, description or fqdn of an item, casefolded */
+struct search_entry {
+    gchar *key;
+    struct menu_item_info *item;
+};
+
+enum {
+    SEARCH_COLUMN_KIND,
+    SEARCH_COLUMN_NAME,
+    SEARCH_COLUMN_HOST,
+    SEARCH_COLUMN_TABLE,
+    SEARCH_N_COLUMNS
+};
+
+/* Events of the same kind on the same host are folded into one entry
+ * of the notification, which shows the details of the first one */
+struct notify_entry {
+    const gchar *title, *summary;
+    gchar *host, *text;
+    guint count;
+};
+
+/* What the notification thread is to show next. Each request replaces
+ * the whole notification, so a newer one makes a pending one stale. */
+struct notify_request {
+    gchar *title, *body;
+
+    /* The last notification was closed, open a new one */
+    gboolean fresh;
+};
+
 struct menu_item_info {
     GtkWidget *menu_item;
+    GList *built_link;
+    struct menu_host *host;
+    GSequenceIter *rank;
+
+    /* Items with the same server and device share a slot in the
+     * index, chained through index_next */
+    GHashTable *index;
+    gchar *index_key;
+    struct menu_item_info *index_next;
+
+    /* Our entries in search_index */
+    GSList *search_entries;
+
     char *name, *server, *device, *description;
     pa_sample_spec sample_spec;
     int sample_spec_valid;
+    pa_probe_state_t probe_state;
+    pa_usec_t rtt;
+
+    /* Discovered by name only, the notification waits for the
+     * resolver */
+    gboolean notify_pending;
 };
 
+static struct notify_entry notify_ring[NOTIFY_RING_SIZE];
+static guint notify_ring_first = 0, notify_ring_n = 0, notify_dropped = 0;
+static guint notify_source = 0;
+static gboolean notify_dirty = FALSE, notify_fresh = FALSE;
+
+/* libnotify makes blocking D-Bus calls, so the notification is only
+ * ever touched from a thread of its own. We hand it at most one
+ * request at a time, protected by notify_mutex. */
 static NotifyNotification *notification = NULL;
-static gchar *last_events = NULL;
+static GThread *notify_thread = NULL;
+static GMutex *notify_mutex = NULL;
+static GCond *notify_cond = NULL;
+static struct notify_request *notify_pending = NULL;
+static gboolean notify_quit = FALSE;
+static uint64_t notify_requests = 0, notify_stale = 0;
 
 static GtkStatusIcon *tray_icon = NULL;
 static gchar *current_server = NULL, *current_sink = NULL, *current_source = NULL;
 static struct menu_item_info *current_source_menu_item_info = NULL, *current_sink_menu_item_info = NULL, *current_server_menu_item_info = NULL;
 static GtkMenu *menu = NULL, *sink_submenu = NULL, *source_submenu = NULL, *server_submenu = NULL;
 static GHashTable *server_hash_table = NULL, *sink_hash_table = NULL, *source_hash_table = NULL;
+static struct menu_hosts server_hosts, sink_hosts, source_hosts;
+static GHashTable *server_index = NULL, *sink_index = NULL, *source_index = NULL;
+static GSequence *search_index = NULL;
+static GtkListStore *search_store = NULL;
+static gboolean search_dirty = FALSE;
+static pa_sample_spec local_sample_spec;
+static gboolean local_sample_spec_valid = FALSE;
+static pa_context *local_context = NULL;
 static GtkWidget *no_servers_menu_item = NULL, *no_sinks_menu_item = NULL, *no_sources_menu_item = NULL;
 static GtkWidget *default_server_menu_item = NULL, *default_sink_menu_item = NULL, *default_source_menu_item = NULL;
 static GtkWidget *other_server_menu_item = NULL, *other_sink_menu_item = NULL, *other_source_menu_item = NULL;
-static GtkTooltips *menu_tooltips = NULL;
 static int updating = 0;
 static time_t startup_time = 0;
 static GConfClient *gconf = NULL;
 static GladeXML *glade_xml = NULL;
+static pa_browse_histogram menu_latency, handoff_latency;
+static guint menu_refresh_source = 0;
+static uint64_t menu_refresh_requests = 0, menu_refreshes = 0;
+static pa_threaded_mainloop *browser_mainloop = NULL;
+static pa_browser *browser = NULL;
+static pa_spscq *browse_queue = NULL;
+static pa_atomic_t browse_idle_pending = PA_ATOMIC_INIT(0);
+static GQueue *browse_backlog = NULL;
+static pa_time_event *browse_retry_event = NULL;
+static pa_prober *prober = NULL;
 static gboolean notify_on_server_discovery = FALSE, notify_on_sink_discovery = FALSE, notify_on_source_discovery = FALSE, no_notify_on_startup = FALSE;
 
 static void set_sink(const char *server, const char *device);
@@ -74,15 +249,178 @@ static void set_server(const char *server);
 
 static void set_x11_props(void);
 
-static gboolean find_predicate(const gchar* name, const struct menu_item_info *m, gpointer userdata) {
+static void schedule_menu_refresh(void);
+static void menu_item_info_detach(struct menu_item_info *i);
+static void search_refresh(void);
+
+static gchar *index_key(const char *server, const char *device) {
+    return g_strconcat(server, "\n", device ? device : "", NULL);
+}
+
+static struct menu_item_info *index_lookup(GHashTable *index, const char *server, const char *device) {
+    struct menu_item_info *m;
+    gchar *k;
+
+    k = index_key(server, device);
+    m = g_hash_table_lookup(index, k);
+    g_free(k);
+
+    return m;
+}
+
+/* Resolved items are found by server and device in constant time */
+static void menu_item_info_index(struct menu_item_info *m) {
+    g_assert(!m->index_key);
+
+    if (!m->server)
+        return;
+
+    m->index_key = index_key(m->server, m->device);
+    m->index_next = g_hash_table_lookup(m->index, m->index_key);
+    g_hash_table_replace(m->index, m->index_key, m);
+}
+
+static void menu_item_info_unindex(struct menu_item_info *m) {
+    struct menu_item_info *i;
+
+    if (!m->index_key)
+        return;
+
+    i = g_hash_table_lookup(m->index, m->index_key);
+    g_assert(i);
+
+    if (i == m) {
+        /* The key is owned by the head of the chain */
+        if (m->index_next)
+            g_hash_table_replace(m->index, m->index_next->index_key, m->index_next);
+        else
+            g_hash_table_remove(m->index, m->index_key);
+    } else {
+        while (i->index_next != m) {
+            i = i->index_next;
+            g_assert(i);
+        }
+
+        i->index_next = m->index_next;
+    }
+
+    g_free(m->index_key);
+    m->index_key = NULL;
+    m->index_next = NULL;
+}
+
+/* Split s into its casefolded words, at anything that is neither a
+ * letter nor a digit */
+static gchar **search_words(const char *s) {
+    GPtrArray *a;
+    gchar *f, *p;
+
+    a = g_ptr_array_new();
+    f = g_utf8_casefold(s, -1);
 
-    return
-        strcmp(m->server, current_server) == 0 &&
-        (!m->device || strcmp(m->device, userdata) == 0);
+    for (p = f; *p;) {
+        gchar *w;
+
+        if (!g_unichar_isalnum(g_utf8_get_char(p))) {
+            p = g_utf8_next_char(p);
+            continue;
+        }
+
+        for (w = p; *p && g_unichar_isalnum(g_utf8_get_char(p)); p = g_utf8_next_char(p))
+            ;
+
+        g_ptr_array_add(a, g_strndup(w, p - w));
+    }
+
+    g_free(f);
+    g_ptr_array_add(a, NULL);
+
+    return (gchar**) g_ptr_array_free(a, FALSE);
+}
+
+/* Entries with the same key are ordered arbitrarily, but the one we
+ * search for with g_sequence_search() goes before all of them */
+static gint search_entry_compare(const struct search_entry *a, const struct search_entry *b, gpointer probe) {
+    int r;
+
+    if ((r = strcmp(a->key, b->key)) != 0)
+        return r;
+
+    if (a == probe)
+        return -1;
+    if (b == probe)
+        return 1;
+
+    return 0;
+}
+
+static void search_entry_free(struct search_entry *e) {
+    g_free(e->key);
+    g_free(e);
+}
+
+static void search_index_add_words(struct menu_item_info *m, const char *s) {
+    gchar **words, **w;
+
+    if (!s)
+        return;
+
+    words = search_words(s);
+
+    for (w = words; *w; w++) {
+        struct search_entry *e;
+
+        e = g_new(struct search_entry, 1);
+        e->key = *w;
+        e->item = m;
+
+        m->search_entries = g_slist_prepend(m->search_entries, g_sequence_insert_sorted(search_index, e, (GCompareDataFunc) search_entry_compare, NULL));
+    }
+
+    /* The words themselves are owned by the entries now */
+    g_free(words);
+}
+
+/* Make the item findable by every word of its name, description and
+ * host name */
+static void search_index_add(struct menu_item_info *m, const pa_browse_info *i) {
+    g_assert(!m->search_entries);
+
+    search_index_add_words(m, i->name);
+    search_index_add_words(m, i->description);
+    search_index_add_words(m, i->fqdn);
+
+    search_dirty = TRUE;
+}
+
+static void search_index_remove(struct menu_item_info *m) {
+    GSList *l;
+
+    for (l = m->search_entries; l; l = l->next)
+        g_sequence_remove(l->data);
+
+    g_slist_free(m->search_entries);
+    m->search_entries = NULL;
+
+    search_dirty = TRUE;
+}
+
+/* Whether any word of the item starts with prefix */
+static gboolean search_item_matches(const struct menu_item_info *m, const gchar *prefix) {
+    GSList *l;
+
+    for (l = m->search_entries; l; l = l->next) {
+        const struct search_entry *e = g_sequence_get(l->data);
+
+        if (g_str_has_prefix(e->key, prefix))
+            return TRUE;
+    }
+
+    return FALSE;
 }
 
 static void look_for_current_menu_item(
-        GHashTable *h,
+        GHashTable *index,
         const char *device,
         int look_for_device,
         struct menu_item_info **current_menu_item_info,
@@ -97,19 +435,19 @@ static void look_for_current_menu_item(
              (strcmp(current_server, (*current_menu_item_info)->server) == 0 &&
               (!look_for_device || strcmp(device, (*current_menu_item_info)->device) == 0)))
         m = *current_menu_item_info;
-    else
-        /* Look for the right entry */
-        m = g_hash_table_find(h, (GHRFunc) find_predicate, (gpointer) device);
+    else if (!(m = index_lookup(index, current_server, look_for_device ? device : NULL)) && look_for_device)
+        /* Items which don't know their device match any */
+        m = index_lookup(index, current_server, NULL);
 
     /* Deactivate the old item */
-    if (*current_menu_item_info)
+    if (*current_menu_item_info && (*current_menu_item_info)->menu_item)
         gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM((*current_menu_item_info)->menu_item), FALSE);
 
     /* Update item */
     *current_menu_item_info = m;
 
     /* Activate the new item */
-    if (*current_menu_item_info)
+    if (*current_menu_item_info && (*current_menu_item_info)->menu_item)
         gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM((*current_menu_item_info)->menu_item), TRUE);
 
     /* Enable/Disable the "Default" menu item */
@@ -118,29 +456,39 @@ static void look_for_current_menu_item(
     /* Enable/Disable the "Other..." menu item and set the tooltip appriately */
     if (!*current_menu_item_info && (look_for_device ? device : current_server)) {
         gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(other_menu_item), TRUE);
-        gtk_tooltips_set_tip(GTK_TOOLTIPS(menu_tooltips), other_menu_item, look_for_device ? device : current_server, NULL);
+        gtk_widget_set_tooltip_text(other_menu_item, look_for_device ? device : current_server);
     } else {
         gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(other_menu_item), FALSE);
-        gtk_tooltips_set_tip(GTK_TOOLTIPS(menu_tooltips), other_menu_item, NULL, NULL);
+        gtk_widget_set_tooltip_text(other_menu_item, NULL);
     }
 }
 
 static void look_for_current_menu_items(void) {
     updating = 1;
-    look_for_current_menu_item(server_hash_table, NULL, FALSE, &current_server_menu_item_info, default_server_menu_item, other_server_menu_item);
-    look_for_current_menu_item(sink_hash_table, current_sink, TRUE, &current_sink_menu_item_info, default_sink_menu_item, other_sink_menu_item);
-    look_for_current_menu_item(source_hash_table, current_source, TRUE, &current_source_menu_item_info, default_source_menu_item, other_source_menu_item);
+    look_for_current_menu_item(server_index, NULL, FALSE, &current_server_menu_item_info, default_server_menu_item, other_server_menu_item);
+    look_for_current_menu_item(sink_index, current_sink, TRUE, &current_sink_menu_item_info, default_sink_menu_item, other_sink_menu_item);
+    look_for_current_menu_item(source_index, current_source, TRUE, &current_source_menu_item_info, default_source_menu_item, other_source_menu_item);
     updating = 0;
 }
 
-static void menu_item_info_free(struct menu_item_info *i) {
-    if (i->menu_item)
-        gtk_widget_destroy(i->menu_item);
+static void menu_item_info_unset(struct menu_item_info *i) {
+    if (prober && i->server)
+        pa_prober_remove(prober, i->server);
 
-    g_free(i->name);
     g_free(i->server);
     g_free(i->device);
     g_free(i->description);
+}
+
+static void menu_item_info_free(struct menu_item_info *i) {
+    if (i->host)
+        menu_item_info_detach(i);
+
+    menu_item_info_unindex(i);
+    search_index_remove(i);
+
+    menu_item_info_unset(i);
+    g_free(i->name);
     g_free(i);
 
     if (current_sink_menu_item_info == i)
@@ -151,15 +499,215 @@ static void menu_item_info_free(struct menu_item_info *i) {
         current_server_menu_item_info = NULL;
 }
 
+static void notify_ring_clear(void) {
+    for (; notify_ring_n > 0; notify_ring_n--) {
+        struct notify_entry *e = &notify_ring[notify_ring_first];
+
+        g_free(e->host);
+        g_free(e->text);
+        notify_ring_first = (notify_ring_first + 1) % NOTIFY_RING_SIZE;
+    }
+
+    notify_dropped = 0;
+    notify_dirty = FALSE;
+}
+
+static gboolean notification_closed_cb(gpointer userdata) {
+
+    /* The next notification starts afresh */
+    notify_ring_clear();
+    notify_fresh = TRUE;
+
+    return FALSE;
+}
+
+/* Depending on the libnotify version this is emitted in the
+ * notification thread or in ours */
 static void notification_closed(void) {
+    g_idle_add(notification_closed_cb, NULL);
+}
+
+static void notify_request_free(struct notify_request *r) {
+    g_free(r->title);
+    g_free(r->body);
+    g_free(r);
+}
+
+/* Runs in the notification thread, unless that couldn't be started */
+static void notify_deliver(const struct notify_request *r) {
+    if (r->fresh && notification) {
+        g_object_unref(G_OBJECT(notification));
+        notification = NULL;
+    }
+
+    if (!notification) {
+        notification = notify_notification_new(r->title, r->body, NULL);
+        notify_notification_set_category(notification, "device.added");
+        notify_notification_set_urgency(notification, NOTIFY_URGENCY_LOW);
+        g_signal_connect_swapped(G_OBJECT(notification), "closed", G_CALLBACK(notification_closed), NULL);
+    } else
+        notify_notification_update(notification, r->title, r->body, "audio-card");
+
+    notify_notification_show(notification, NULL);
+}
+
+static gpointer notify_thread_func(gpointer userdata) {
+    g_mutex_lock(notify_mutex);
+
+    for (;;) {
+        struct notify_request *r;
+
+        while (!notify_pending && !notify_quit)
+            g_cond_wait(notify_cond, notify_mutex);
+
+        if (notify_quit)
+            break;
+
+        r = notify_pending;
+        notify_pending = NULL;
+
+        g_mutex_unlock(notify_mutex);
+        notify_deliver(r);
+        notify_request_free(r);
+        g_mutex_lock(notify_mutex);
+    }
+
+    g_mutex_unlock(notify_mutex);
+
     if (notification) {
         g_object_unref(G_OBJECT(notification));
         notification = NULL;
     }
+
+    return NULL;
+}
+
+/* Never waits for the notification daemon: if the thread is still busy
+ * with the last request when the next one comes in, the one still
+ * pending is dropped */
+static void notify_submit(struct notify_request *r) {
+
+    if (!notify_thread) {
+        notify_deliver(r);
+        notify_request_free(r);
+        return;
+    }
+
+    g_mutex_lock(notify_mutex);
+
+    notify_requests++;
+
+    if (notify_pending) {
+        r->fresh = r->fresh || notify_pending->fresh;
+        notify_request_free(notify_pending);
+        notify_stale++;
+    }
+
+    notify_pending = r;
+    g_cond_signal(notify_cond);
+
+    g_mutex_unlock(notify_mutex);
+}
+
+static void setup_notify_thread(void) {
+    GError *error = NULL;
+
+    notify_mutex = g_mutex_new();
+    notify_cond = g_cond_new();
+
+    if (!(notify_thread = g_thread_create(notify_thread_func, NULL, TRUE, &error))) {
+        g_warning("Failed to start notification thread: %s", error->message);
+        g_error_free(error);
+    }
 }
 
-static void notify_event(const char *title, const char*text) {
-    char *s;
+static void shutdown_notify_thread(void) {
+    if (notify_thread) {
+        g_mutex_lock(notify_mutex);
+        notify_quit = TRUE;
+        g_cond_signal(notify_cond);
+        g_mutex_unlock(notify_mutex);
+
+        g_thread_join(notify_thread);
+        notify_thread = NULL;
+    }
+
+    if (notify_pending) {
+        notify_request_free(notify_pending);
+        notify_pending = NULL;
+    }
+
+    if (notification) {
+        g_object_unref(G_OBJECT(notification));
+        notification = NULL;
+    }
+
+    if (notify_cond)
+        g_cond_free(notify_cond);
+    if (notify_mutex)
+        g_mutex_free(notify_mutex);
+}
+
+/* Render the entries, oldest first */
+static gchar *notify_render(void) {
+    GString *s;
+    guint j;
+
+    s = g_string_new(NULL);
+
+    if (notify_dropped > 0)
+        g_string_append_printf(s, "<i>%u earlier events not shown</i>", notify_dropped);
+
+    for (j = 0; j < notify_ring_n; j++) {
+        const struct notify_entry *e = &notify_ring[(notify_ring_first + j) % NOTIFY_RING_SIZE];
+        gchar *t;
+
+        if (e->count > 1)
+            t = g_markup_printf_escaped(e->summary, e->count, e->host);
+        else
+            t = g_markup_escape_text(e->text, -1);
+
+        g_string_append_printf(s, "%s<i>%s</i>\n%s", s->len > 0 ? "\n\n" : "", e->title, t);
+        g_free(t);
+    }
+
+    return g_string_free(s, FALSE);
+}
+
+static void notify_flush(void) {
+    struct notify_request *r;
+
+    g_assert(notify_ring_n > 0);
+
+    notify_dirty = FALSE;
+
+    r = g_new(struct notify_request, 1);
+    r->title = g_strdup(notify_ring[(notify_ring_first + notify_ring_n - 1) % NOTIFY_RING_SIZE].title);
+    r->body = notify_render();
+    r->fresh = notify_fresh;
+    notify_fresh = FALSE;
+
+    notify_submit(r);
+}
+
+static gboolean notify_timeout_cb(gpointer userdata) {
+    if (!notify_dirty) {
+        notify_source = 0;
+        return FALSE;
+    }
+
+    notify_flush();
+    return TRUE;
+}
+
+static gchar *menu_item_info_tooltip(struct menu_item_info *m);
+
+/* summary is a format string taking the number of events and the
+ * host. Details are only shown for the first event on a host, the
+ * rest is counted. */
+static void notify_event(const gchar *title, const gchar *summary, struct menu_item_info *m, gboolean details) {
+    struct notify_entry *e;
+    guint j;
 
     if (no_notify_on_startup && time(NULL)-startup_time <= 5)
         return;
@@ -167,24 +715,47 @@ static void notify_event(const char *title, const char*text) {
     if (!notify_is_initted())
         return;
 
-    if (!notification) {
-        s = g_strdup_printf("<i>%s</i>\n%s", title, text);
-        notification = notify_notification_new(title, s, NULL);
-        notify_notification_set_category(notification, "device.added");
-        notify_notification_set_urgency(notification, NOTIFY_URGENCY_LOW);
-        g_signal_connect_swapped(G_OBJECT(notification), "closed", G_CALLBACK(notification_closed), NULL);
-    } else {
-        s = g_strdup_printf("%s\n\n<i>%s</i>\n%s", last_events, title, text);
-        notify_notification_update(notification, title, s, "audio-card");
+    for (j = 0; j < notify_ring_n; j++) {
+        e = &notify_ring[(notify_ring_first + j) % NOTIFY_RING_SIZE];
+
+        if (e->title == title && strcmp(e->host, m->host->label) == 0) {
+            e->count++;
+            goto finish;
+        }
     }
 
-    g_free(last_events);
-    last_events = s;
+    if (notify_ring_n >= NOTIFY_RING_SIZE) {
+        e = &notify_ring[notify_ring_first];
 
-    notify_notification_show(notification, NULL);
+        notify_dropped += e->count;
+        g_free(e->host);
+        g_free(e->text);
+        notify_ring_first = (notify_ring_first + 1) % NOTIFY_RING_SIZE;
+        notify_ring_n--;
+    }
+
+    e = &notify_ring[(notify_ring_first + notify_ring_n) % NOTIFY_RING_SIZE];
+    notify_ring_n++;
+
+    e->title = title;
+    e->summary = summary;
+    e->host = g_strdup(m->host->label);
+    e->text = details ? menu_item_info_tooltip(m) : g_strdup_printf("Name: %s", m->name);
+    e->count = 1;
+
+finish:
+    notify_dirty = TRUE;
+
+    /* The first event is shown right away, whatever follows within
+     * the interval at its end */
+    if (!notify_source) {
+        notify_flush();
+        notify_source = g_timeout_add(NOTIFY_INTERVAL_MSEC, notify_timeout_cb, NULL);
+    }
 }
 
-static GtkWidget *append_radio_menu_item(GtkMenu *menu, const gchar *label, gboolean mnemonic, gboolean prepend) {
+/* Pass -1 as position to append the item */
+static GtkWidget *insert_radio_menu_item(GtkMenu *menu, const gchar *label, gboolean mnemonic, gint position) {
     GtkWidget *item;
 
     if (mnemonic)
@@ -194,11 +765,7 @@ static GtkWidget *append_radio_menu_item(GtkMenu *menu, const gchar *label, gboo
 
     gtk_check_menu_item_set_draw_as_radio(GTK_CHECK_MENU_ITEM(item), TRUE);
     gtk_widget_show_all(item);
-
-    if (prepend)
-        gtk_menu_shell_prepend(GTK_MENU_SHELL(menu), item);
-    else
-        gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
+    gtk_menu_shell_insert(GTK_MENU_SHELL(menu), item, position);
 
     return item;
 }
@@ -215,96 +782,812 @@ static void server_change_cb(struct menu_item_info *m) {
     set_server(m->server);
 }
 
-static struct menu_item_info* add_menu_item_info(GHashTable *h, GtkMenu *menu, const pa_browse_info *i, GCallback callback) {
+static gboolean menu_item_info_spec_matches(const struct menu_item_info *m) {
+    return local_sample_spec_valid && m->sample_spec_valid && pa_sample_spec_equal(&m->sample_spec, &local_sample_spec);
+}
+
+static gchar *menu_item_info_tooltip(struct menu_item_info *m) {
+    char l[32];
+
+    if (m->probe_state == PA_PROBE_REACHABLE)
+        g_snprintf(l, sizeof(l), "%0.1f ms", (double) m->rtt / PA_USEC_PER_MSEC);
+    else
+        g_strlcpy(l, m->probe_state == PA_PROBE_UNREACHABLE ? "unreachable" : "n/a", sizeof(l));
+
+    if (!m->server)
+        return g_strdup_printf(
+                "Name: %s",
+                m->name);
+    else if (!m->device)
+        return g_strdup_printf(
+                "Name: %s\n"
+                "Server: %s\n"
+                "Latency: %s",
+                m->name,
+                m->server,
+                l);
+    else {
+        char t[PA_SAMPLE_SPEC_SNPRINT_MAX];
+        return g_strdup_printf(
+                "Name: %s\n"
+                "Server: %s\n"
+                "Device: %s\n"
+                "Description: %s\n"
+                "Sample Specification: %s%s\n"
+                "Latency: %s",
+                m->name,
+                m->server,
+                m->device,
+                m->description ? m->description : "n/a",
+                m->sample_spec_valid ? pa_sample_spec_snprint(t, sizeof(t), &m->sample_spec) : "n/a",
+                menu_item_info_spec_matches(m) ? " (same as local)" : "",
+                l);
+    }
+}
+
+/* Not resolved yet or not reachable, nothing we could switch to */
+static void menu_item_info_update_sensitive(struct menu_item_info *m) {
+    if (m->menu_item)
+        gtk_widget_set_sensitive(m->menu_item, m->server && m->probe_state != PA_PROBE_UNREACHABLE);
+}
+
+static int menu_item_info_reachability(const struct menu_item_info *m) {
+    if (!m->server)
+        return 1;
+
+    switch (m->probe_state) {
+        case PA_PROBE_REACHABLE:
+            return 0;
+        case PA_PROBE_UNREACHABLE:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+/* Reachable items first, fastest first, then those matching our
+ * sample spec, then by name */
+static gint rank_compare(const struct menu_item_info *a, const struct menu_item_info *b, gpointer userdata) {
+    int ra, rb;
+    gboolean ma, mb;
+
+    ra = menu_item_info_reachability(a);
+    rb = menu_item_info_reachability(b);
+    if (ra != rb)
+        return ra < rb ? -1 : 1;
+
+    if (ra == 0) {
+        pa_usec_t ta = a->rtt / RANK_RTT_GRANULARITY_USEC, tb = b->rtt / RANK_RTT_GRANULARITY_USEC;
+
+        if (ta != tb)
+            return ta < tb ? -1 : 1;
+    }
+
+    ma = menu_item_info_spec_matches(a);
+    mb = menu_item_info_spec_matches(b);
+    if (ma != mb)
+        return ma ? -1 : 1;
+
+    return strcmp(a->name, b->name);
+}
+
+/* The text is only made when the tooltip is about to be shown */
+static gboolean menu_item_query_tooltip_cb(GtkWidget *w, gint x, gint y, gboolean keyboard_mode, GtkTooltip *tooltip, struct menu_item_info *m) {
+    gchar *c;
+
+    c = menu_item_info_tooltip(m);
+    gtk_tooltip_set_text(tooltip, c);
+    g_free(c);
+
+    return TRUE;
+}
+
+/* Have a tooltip that is shown right now made again */
+static void menu_item_info_update_tooltip(struct menu_item_info *m) {
+    if (m->menu_item)
+        gtk_widget_trigger_tooltip_query(m->menu_item);
+}
+
+static void menu_window_build_item(struct menu_window *w, struct menu_item_info *m, GtkMenu *page, gint position) {
+    g_assert(!m->menu_item);
+
+    m->menu_item = insert_radio_menu_item(page, m->name, FALSE, position);
+    g_signal_connect_swapped(G_OBJECT(m->menu_item), "activate", w->callback, m);
+
+    if (m == current_server_menu_item_info || m == current_sink_menu_item_info || m == current_source_menu_item_info) {
+        updating = 1;
+        gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(m->menu_item), TRUE);
+        updating = 0;
+    }
+
+    gtk_widget_set_has_tooltip(m->menu_item, TRUE);
+    g_signal_connect(G_OBJECT(m->menu_item), "query-tooltip", G_CALLBACK(menu_item_query_tooltip_cb), m);
+
+    menu_item_info_update_sensitive(m);
+
+    g_queue_push_tail(w->built, m);
+    m->built_link = g_queue_peek_tail_link(w->built);
+}
+
+static void menu_window_unbuild_item(struct menu_window *w, struct menu_item_info *m) {
+    g_assert(m->menu_item);
+
+    g_queue_delete_link(w->built, m->built_link);
+    m->built_link = NULL;
+
+    gtk_widget_destroy(m->menu_item);
+    m->menu_item = NULL;
+}
+
+/* Drop all pages from the kth on, except for the first one, which
+ * is the submenu itself */
+static void menu_window_truncate(struct menu_window *w, guint k) {
+    k = MAX(k, 1);
+
+    while (w->pages->len > k) {
+        /* Takes the page, which is its submenu, with it */
+        gtk_widget_destroy(g_ptr_array_index(w->more_items, w->pages->len - 2));
+        g_ptr_array_remove_index(w->more_items, w->pages->len - 2);
+        g_ptr_array_remove_index(w->pages, w->pages->len - 1);
+    }
+
+    w->n_built_pages = MIN(w->n_built_pages, k);
+}
+
+/* Move an item that has a widget to the given position of a page,
+ * which may be another one than it is on now */
+static void menu_window_place_item(struct menu_item_info *m, GtkMenu *page, gint position) {
+    GtkWidget *parent;
+
+    g_assert(m->menu_item);
+
+    if ((parent = gtk_widget_get_parent(m->menu_item)) == GTK_WIDGET(page)) {
+        gtk_menu_reorder_child(page, m->menu_item, position);
+        return;
+    }
+
+    g_object_ref(m->menu_item);
+    gtk_container_remove(GTK_CONTAINER(parent), m->menu_item);
+    gtk_menu_shell_insert(GTK_MENU_SHELL(page), m->menu_item, position);
+    g_object_unref(m->menu_item);
+}
+
+static void menu_window_page_show_cb(GtkWidget *page, struct menu_window *w);
+
+/* Give the kth page a "More..." item at position that leads to the
+ * next one */
+static void menu_window_add_more_item(struct menu_window *w, guint k, gint position) {
+    GtkWidget *item, *next;
+
+    g_assert(w->more_items->len == k);
+
+    item = gtk_menu_item_new_with_mnemonic("_More...");
+    next = gtk_menu_new();
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(item), next);
+    g_signal_connect(G_OBJECT(next), "show", G_CALLBACK(menu_window_page_show_cb), w);
+    gtk_widget_show(item);
+    gtk_menu_shell_insert(GTK_MENU_SHELL(g_ptr_array_index(w->pages, k)), item, position);
+
+    g_ptr_array_add(w->more_items, item);
+    g_ptr_array_add(w->pages, next);
+}
+
+static void menu_window_build_page(struct menu_window *w, guint k) {
+    GtkMenu *page;
+    GSequenceIter *i;
+    gint n;
+
+    g_assert(k == w->n_built_pages);
+    g_assert(k < w->pages->len);
+
+    page = g_ptr_array_index(w->pages, k);
+
+    i = g_sequence_get_iter_at_pos(w->ranking, k * MENU_PAGE_SIZE);
+    for (n = 0; n < MENU_PAGE_SIZE && !g_sequence_iter_is_end(i); n++, i = g_sequence_iter_next(i))
+        menu_window_build_item(w, g_sequence_get(i), page, n);
+
+    w->n_built_pages = k + 1;
+
+    if (g_sequence_iter_is_end(i)) {
+        menu_window_truncate(w, k + 1);
+        return;
+    }
+
+    if (w->more_items->len <= k)
+        menu_window_add_more_item(w, k, n);
+}
+
+static void menu_window_page_show_cb(GtkWidget *page, struct menu_window *w) {
+    guint k;
+
+    for (k = w->n_built_pages; k < w->pages->len; k++)
+        if (g_ptr_array_index(w->pages, k) == page) {
+
+            /* Pages are only reachable through the ones before them */
+            g_assert(k == w->n_built_pages);
+            menu_window_build_page(w, k);
+            break;
+        }
+}
+
+static void menu_window_release(struct menu_window *w) {
     struct menu_item_info *m;
+
+    while ((m = g_queue_peek_head(w->built)))
+        menu_window_unbuild_item(w, m);
+
+    menu_window_truncate(w, 0);
+    w->n_built_pages = 0;
+    w->dirty = FALSE;
+}
+
+/* Bring the pages that are built up to date with the ranking. The
+ * widgets items already have are moved to their new place, only items
+ * that just made it onto a built page get one made, and only those
+ * that fell off the built pages lose theirs. */
+static void menu_window_sync(struct menu_window *w) {
+    struct menu_item_info *m;
+    GSequenceIter *i;
+    GList *l, *next;
+    guint n_items, n_pages, last, r;
+
+    w->dirty = FALSE;
+
+    n_items = (guint) g_sequence_get_length(w->ranking);
+    n_pages = MIN(w->n_built_pages, MAX((n_items + MENU_PAGE_SIZE - 1) / MENU_PAGE_SIZE, 1));
+    last = MIN(n_pages * MENU_PAGE_SIZE, n_items);
+
+    /* In rank order, so that everything in front of the position we
+     * place an item at is already where it belongs */
+    for (r = 0, i = g_sequence_get_begin_iter(w->ranking); r < last; r++, i = g_sequence_iter_next(i)) {
+        GtkMenu *page = g_ptr_array_index(w->pages, r / MENU_PAGE_SIZE);
+
+        m = g_sequence_get(i);
+
+        if (m->menu_item)
+            menu_window_place_item(m, page, r % MENU_PAGE_SIZE);
+        else
+            menu_window_build_item(w, m, page, r % MENU_PAGE_SIZE);
+    }
+
+    for (l = w->built->head; l; l = next) {
+        next = l->next;
+        m = l->data;
+
+        if ((guint) g_sequence_iter_get_position(m->rank) >= last)
+            menu_window_unbuild_item(w, m);
+    }
+
+    /* The last built page needs a "More..." item if and only if there
+     * is more to show */
+    if (last < n_items) {
+        menu_window_truncate(w, n_pages + 1);
+
+        if (w->more_items->len < n_pages)
+            menu_window_add_more_item(w, n_pages - 1, MENU_PAGE_SIZE);
+    } else
+        menu_window_truncate(w, n_pages);
+
+    w->n_built_pages = n_pages;
+}
+
+static void menu_window_refresh(struct menu_window *w) {
+    if (!w->dirty)
+        return;
+
+    /* Hidden windows are about to be released anyway */
+    if (w->shown)
+        menu_window_sync(w);
+}
+
+static gboolean menu_window_release_cb(gpointer userdata) {
+    struct menu_window *w = userdata;
+
+    w->release_source = 0;
+
+    if (!w->shown)
+        menu_window_release(w);
+
+    return FALSE;
+}
+
+static void menu_window_show_cb(GtkWidget *menu, struct menu_window *w) {
+    w->shown = TRUE;
+
+    if (w->n_built_pages == 0)
+        menu_window_build_page(w, 0);
+    else if (w->dirty)
+        menu_window_sync(w);
+}
+
+/* Released from idle, since this may be emitted in the middle of
+ * hiding the pages we are about to destroy */
+static void menu_window_hide_cb(GtkWidget *menu, struct menu_window *w) {
+    w->shown = FALSE;
+
+    if (!w->release_source)
+        w->release_source = g_idle_add(menu_window_release_cb, w);
+}
+
+static void menu_window_init(struct menu_window *w, GtkMenu *menu, GCallback callback) {
+    w->menu = menu;
+    w->ranking = g_sequence_new(NULL);
+    w->callback = callback;
+    w->built = g_queue_new();
+    w->pages = g_ptr_array_new();
+    g_ptr_array_add(w->pages, menu);
+    w->more_items = g_ptr_array_new();
+    w->n_built_pages = 0;
+    w->shown = w->dirty = FALSE;
+    w->release_source = 0;
+
+    g_signal_connect(G_OBJECT(menu), "show", G_CALLBACK(menu_window_show_cb), w);
+    g_signal_connect(G_OBJECT(menu), "hide", G_CALLBACK(menu_window_hide_cb), w);
+}
+
+static void menu_window_done(struct menu_window *w) {
+    if (!w->ranking)
+        return;
+
+    g_signal_handlers_disconnect_matched(G_OBJECT(w->menu), G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, w);
+
+    if (w->release_source)
+        g_source_remove(w->release_source);
+
+    g_sequence_free(w->ranking);
+    g_queue_free(w->built);
+    g_ptr_array_free(w->pages, TRUE);
+    g_ptr_array_free(w->more_items, TRUE);
+}
+
+/* Something at this rank was added, removed or moved. If that is on
+ * a built page, or decides whether the last built page needs a
+ * "More..." item, the built pages are synced when idle. */
+static void menu_window_changed(struct menu_window *w, gint position) {
+    if (w->n_built_pages <= 0 || position > (gint) (w->n_built_pages * MENU_PAGE_SIZE))
+        return;
+
+    if (!w->dirty) {
+        w->dirty = TRUE;
+        schedule_menu_refresh();
+    }
+}
+
+/* Move the item to where its ranking says. Call this right after
+ * anything the ranking is based on changed. */
+static void menu_item_info_rerank(struct menu_item_info *m) {
+    struct menu_window *w = &m->host->window;
+    gint old_position, position;
+
+    if (!m->rank)
+        return;
+
+    old_position = g_sequence_iter_get_position(m->rank);
+    g_sequence_sort_changed(m->rank, (GCompareDataFunc) rank_compare, NULL);
+    position = g_sequence_iter_get_position(m->rank);
+
+    if (position == old_position)
+        return;
+
+    /* Within a page we can move the widget without touching the others */
+    if (m->menu_item && !w->dirty &&
+        old_position / MENU_PAGE_SIZE == position / MENU_PAGE_SIZE &&
+        (guint) (position / MENU_PAGE_SIZE) < w->n_built_pages)
+        gtk_menu_reorder_child(g_ptr_array_index(w->pages, position / MENU_PAGE_SIZE), m->menu_item, position % MENU_PAGE_SIZE);
+    else {
+        menu_window_changed(w, old_position);
+        menu_window_changed(w, position);
+    }
+}
+
+static void rerank_host(const gchar *key, struct menu_host *host) {
+    g_sequence_sort(host->window.ranking, (GCompareDataFunc) rank_compare, NULL);
+    menu_window_changed(&host->window, 0);
+}
+
+static void rerank_menu(struct menu_hosts *hs) {
+    g_hash_table_foreach(hs->hosts, (GHFunc) rerank_host, NULL);
+}
+
+/* Items are grouped by fqdn, by server cookie if that is all we know,
+ * and unresolved items in a group of their own */
+static gchar *host_key(const pa_browse_info *i) {
+    if (i->fqdn)
+        return g_strdup(i->fqdn);
+    else if (i->cookie)
+        return g_strdup_printf("cookie:%08x", *i->cookie);
+    else if (i->server)
+        return g_strdup(i->server);
+    else
+        return g_strdup("");
+}
+
+static gchar *host_label(const pa_browse_info *i) {
+    if (i->fqdn)
+        return g_strdup(i->fqdn);
+    else if (i->server)
+        return g_strndup(i->server, strcspn(i->server, " "));
+    else
+        return g_strdup("Unresolved");
+}
+
+/* Hosts by name, the unresolved ones last */
+static gint host_compare(const struct menu_host *a, const struct menu_host *b, gpointer userdata) {
+    int r;
+
+    if (!*a->key != !*b->key)
+        return *a->key ? -1 : 1;
+
+    if ((r = strcmp(a->label, b->label)) != 0)
+        return r;
+
+    return strcmp(a->key, b->key);
+}
+
+static void menu_host_update_label(struct menu_host *host) {
     gchar *c;
-    const gchar *title;
-    gboolean b;
 
-    m = g_new(struct menu_item_info, 1);
+    c = g_strdup_printf("%s (%u)", host->label, host->n_items);
+    gtk_label_set_text(GTK_LABEL(gtk_bin_get_child(GTK_BIN(host->menu_item))), c);
+    g_free(c);
+}
+
+/* Find the host the item is on, or add it to the submenu. Only the
+ * host's menu item is made here, its items are built when its own
+ * submenu is shown. */
+static struct menu_host *menu_host_get(struct menu_hosts *hs, const pa_browse_info *i) {
+    struct menu_host *host;
+    GtkWidget *submenu;
+    gchar *k;
+
+    k = host_key(i);
+
+    if ((host = g_hash_table_lookup(hs->hosts, k))) {
+        g_free(k);
+        return host;
+    }
+
+    host = g_new(struct menu_host, 1);
+    host->hosts = hs;
+    host->key = k;
+    host->label = host_label(i);
+    host->n_items = 0;
+    host->order = g_sequence_insert_sorted(hs->order, host, (GCompareDataFunc) host_compare, NULL);
+    g_hash_table_insert(hs->hosts, host->key, host);
+
+    submenu = gtk_menu_new();
+    menu_window_init(&host->window, GTK_MENU(submenu), hs->callback);
+
+    host->menu_item = gtk_menu_item_new_with_label(host->label);
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(host->menu_item), submenu);
+    gtk_widget_show(host->menu_item);
+    gtk_menu_shell_insert(GTK_MENU_SHELL(hs->menu), host->menu_item, g_sequence_iter_get_position(host->order));
+
+    return host;
+}
+
+static void menu_host_free(struct menu_host *host) {
+    g_assert(host->n_items == 0);
+
+    g_hash_table_remove(host->hosts->hosts, host->key);
+    g_sequence_remove(host->order);
+
+    menu_window_done(&host->window);
+
+    /* Takes the submenu and its pages with it */
+    gtk_widget_destroy(host->menu_item);
+
+    g_free(host->key);
+    g_free(host->label);
+    g_free(host);
+}
+
+static void menu_item_info_attach(struct menu_item_info *m, struct menu_host *host) {
+    g_assert(!m->host);
+
+    m->host = host;
+    m->rank = g_sequence_insert_sorted(host->window.ranking, m, (GCompareDataFunc) rank_compare, NULL);
+    menu_window_changed(&host->window, g_sequence_iter_get_position(m->rank));
+
+    host->n_items++;
+    menu_host_update_label(host);
+}
+
+static void menu_item_info_detach(struct menu_item_info *m) {
+    struct menu_host *host = m->host;
+    gint position;
+
+    g_assert(host);
+
+    position = g_sequence_iter_get_position(m->rank);
+
+    if (m->menu_item)
+        menu_window_unbuild_item(&host->window, m);
+
+    g_sequence_remove(m->rank);
+    m->rank = NULL;
+    m->host = NULL;
+
+    if (--host->n_items == 0) {
+        menu_host_free(host);
+        return;
+    }
+
+    menu_window_changed(&host->window, position);
+    menu_host_update_label(host);
+}
+
+static void menu_hosts_init(struct menu_hosts *hs, GtkMenu *menu, GCallback callback) {
+    hs->menu = menu;
+    hs->callback = callback;
+    hs->hosts = g_hash_table_new(g_str_hash, g_str_equal);
+    hs->order = g_sequence_new(NULL);
+}
+
+/* Hosts go away with their last item */
+static void menu_hosts_done(struct menu_hosts *hs) {
+    if (!hs->hosts)
+        return;
+
+    g_assert(g_hash_table_size(hs->hosts) == 0);
+
+    g_hash_table_destroy(hs->hosts);
+    g_sequence_free(hs->order);
+}
+
+/* Services are normally only resolved once their menu is opened. Some
+ * can't wait that long: preferred_sink() can only pick among sinks
+ * whose sample spec is known, and a discovery notification is only
+ * shown once there is something to show besides the name. */
+static void resolve_eagerly(void) {
+    pa_browse_flags_t flags = 0;
+
+    if (!browser)
+        return;
+
+    if (local_sample_spec_valid || notify_on_sink_discovery)
+        flags |= PA_BROWSE_FOR_SINKS;
+    if (notify_on_source_discovery)
+        flags |= PA_BROWSE_FOR_SOURCES;
+    if (notify_on_server_discovery)
+        flags |= PA_BROWSE_FOR_SERVERS;
+
+    if (!flags)
+        return;
+
+    pa_threaded_mainloop_lock(browser_mainloop);
+    pa_browser_resolve(browser, flags);
+    pa_threaded_mainloop_unlock(browser_mainloop);
+}
+
+static void set_local_sample_spec(const pa_sample_spec *ss) {
+    char t[PA_SAMPLE_SPEC_SNPRINT_MAX];
+
+    if (local_sample_spec_valid && pa_sample_spec_equal(ss, &local_sample_spec))
+        return;
+
+    local_sample_spec = *ss;
+    local_sample_spec_valid = TRUE;
+
+    g_message("Preferring devices with sample spec %s.", pa_sample_spec_snprint(t, sizeof(t), ss));
+
+    /* The ranking of everything that has a sample spec changed */
+    rerank_menu(&sink_hosts);
+    rerank_menu(&source_hosts);
+
+    resolve_eagerly();
+}
+
+/* The best ranked sink on the server that plays our sample spec
+ * without resampling, if there is one */
+static const char *preferred_sink(const char *server) {
+    GSequenceIter *h, *i;
+    struct menu_item_info *best = NULL;
+
+    if (!server || !local_sample_spec_valid)
+        return NULL;
+
+    for (h = g_sequence_get_begin_iter(sink_hosts.order); !g_sequence_iter_is_end(h); h = g_sequence_iter_next(h)) {
+        struct menu_host *host = g_sequence_get(h);
+
+        for (i = g_sequence_get_begin_iter(host->window.ranking); !g_sequence_iter_is_end(i); i = g_sequence_iter_next(i)) {
+            struct menu_item_info *m = g_sequence_get(i);
+
+            if (m->server &&
+                m->device &&
+                strcmp(m->server, server) == 0 &&
+                m->probe_state != PA_PROBE_UNREACHABLE &&
+                menu_item_info_spec_matches(m)) {
+
+                /* The rest of this host ranks below */
+                if (!best || rank_compare(m, best, NULL) < 0)
+                    best = m;
+                break;
+            }
+        }
+    }
+
+    return best ? best->device : NULL;
+}
 
-    m->name = g_strdup(i->name);
+static void menu_item_info_set(struct menu_item_info *m, const pa_browse_info *i) {
     m->server = g_strdup(i->server);
     m->device = g_strdup(i->device);
     m->description = g_strdup(i->description);
     if ((m->sample_spec_valid = !!i->sample_spec))
         m->sample_spec = *i->sample_spec;
 
-    m->menu_item = append_radio_menu_item(menu, m->name, FALSE, TRUE);
-    g_signal_connect_swapped(G_OBJECT(m->menu_item), "activate", callback, m);
+    m->probe_state = PA_PROBE_UNKNOWN;
+    m->rtt = 0;
 
-    if (!m->device)
-        c = g_strdup_printf(
-                "Name: %s\n"
-                "Server: %s",
-                i->name,
-                i->server);
-    else {
-        char t[PA_SAMPLE_SPEC_SNPRINT_MAX];
-        c = g_strdup_printf(
-                "Name: %s\n"
-                "Server: %s\n"
-                "Device: %s\n"
-                "Description: %s\n"
-                "Sample Specification: %s",
-                i->name,
-                i->server,
-                i->device,
-                i->description ? i->description : "n/a",
-                m->sample_spec_valid ? pa_sample_spec_snprint(t, sizeof(t), &m->sample_spec) : "n/a");
-    }
+    if (prober && m->server && pa_prober_add(prober, m->server) >= 0)
+        m->probe_state = pa_prober_get(prober, m->server, &m->rtt);
+
+    menu_item_info_update_sensitive(m);
+}
 
-    gtk_tooltips_set_tip(GTK_TOOLTIPS(menu_tooltips), m->menu_item, c, NULL);
+static void notify_discovery(GHashTable *h, struct menu_item_info *m) {
+    const gchar *title, *summary;
+    gboolean b;
 
-    if (menu == sink_submenu) {
+    if (h == sink_hash_table) {
         title = "Networked Audio Sink Discovered";
+        summary = "%u sinks appeared on %s";
         b = notify_on_sink_discovery;
-    } else if (menu == source_submenu) {
+    } else if (h == source_hash_table) {
         title = "Networked Audio Source Discovered";
+        summary = "%u sources appeared on %s";
         b = notify_on_source_discovery;
     } else {
         title = "Networked Audio Server Discovered";
+        summary = "%u servers appeared on %s";
         b = notify_on_server_discovery;
     }
 
+    /* With PA_BROWSE_LAZY_RESOLVE the item has nothing but a name at
+     * first. Wait for the UPDATE that brings the rest. */
+    if ((m->notify_pending = b && !m->server))
+        return;
+
     if (b)
-        notify_event(title, c);
+        notify_event(title, summary, m, TRUE);
+}
 
-    g_free(c);
-    g_hash_table_insert(h, m->name, m);
+static void update_menu_item_info(GHashTable *h, GHashTable *index, struct menu_hosts *hs, const pa_browse_info *i);
+
+static struct menu_item_info* add_menu_item_info(GHashTable *h, GHashTable *index, struct menu_hosts *hs, const pa_browse_info *i) {
+    struct menu_item_info *m;
+
+    /* A second NEW for a name we already have must not replace the
+     * item: the table would keep the old key and free it with it */
+    if ((m = g_hash_table_lookup(h, i->name))) {
+        update_menu_item_info(h, index, hs, i);
+        return m;
+    }
+
+    m = g_new(struct menu_item_info, 1);
+
+    m->name = g_strdup(i->name);
+    m->menu_item = NULL;
+    m->built_link = NULL;
+    m->host = NULL;
+    m->rank = NULL;
+    m->index = index;
+    m->index_key = NULL;
+    m->index_next = NULL;
+    m->search_entries = NULL;
+    m->notify_pending = FALSE;
+    menu_item_info_set(m, i);
+    menu_item_info_index(m);
+    search_index_add(m, i);
+
+    /* The widget is only made when the item's page is shown */
+    menu_item_info_attach(m, menu_host_get(hs, i));
+
+    notify_discovery(h, m);
+
+    g_hash_table_replace(h, m->name, m);
 
     return m;
 }
 
+/* Patch an existing item in place instead of rebuilding it */
+static void update_menu_item_info(GHashTable *h, GHashTable *index, struct menu_hosts *hs, const pa_browse_info *i) {
+    struct menu_item_info *m, old;
+    struct menu_host *host;
+
+    if (!(m = g_hash_table_lookup(h, i->name))) {
+        add_menu_item_info(h, index, hs, i);
+        return;
+    }
+
+    /* Take the new probe reference before dropping the old one, so
+     * that an unchanged server keeps its results */
+    menu_item_info_unindex(m);
+    old = *m;
+    menu_item_info_set(m, i);
+    menu_item_info_unset(&old);
+    menu_item_info_index(m);
+    search_index_remove(m);
+    search_index_add(m, i);
+
+    /* Resolving an item usually moves it to the host it is on */
+    if ((host = menu_host_get(hs, i)) != m->host) {
+        menu_item_info_detach(m);
+        menu_item_info_attach(m, host);
+    } else
+        menu_item_info_rerank(m);
+
+    menu_item_info_update_tooltip(m);
+
+    if (m->notify_pending)
+        notify_discovery(h, m);
+}
+
 static void remove_menu_item_info(GHashTable *h, const pa_browse_info *i) {
     struct menu_item_info *m;
-    const gchar *title;
-    gchar *c;
+    const gchar *title, *summary;
     gboolean b;
 
     if (!(m = g_hash_table_lookup(h, i->name)))
         return;
 
+    /* Nobody was told it was there */
+    if (m->notify_pending) {
+        g_hash_table_remove(h, i->name);
+        return;
+    }
+
     if (h == sink_hash_table) {
         title = "Networked Audio Sink Disappeared";
+        summary = "%u sinks disappeared from %s";
         b = notify_on_sink_discovery;
     } else if (h == source_hash_table) {
         title = "Networked Audio Source Disappeared";
+        summary = "%u sources disappeared from %s";
         b = notify_on_source_discovery;
     } else {
         title = "Networked Audio Server Disappeared";
+        summary = "%u servers disappeared from %s";
         b = notify_on_server_discovery;
     }
 
-    c = g_strdup_printf("Name: %s", i->name);
-
     if (b)
-        notify_event(title, c);
-    g_free(c);
+        notify_event(title, summary, m, FALSE);
 
     g_hash_table_remove(h, i->name);
 }
 
+struct probe_result {
+    const char *server;
+    pa_probe_state_t state;
+    pa_usec_t rtt;
+};
+
+static void update_probe_result(const gchar *name, struct menu_item_info *m, const struct probe_result *r) {
+    if (!m->server || strcmp(m->server, r->server) != 0)
+        return;
+
+    m->probe_state = r->state;
+    m->rtt = r->rtt;
+    menu_item_info_rerank(m);
+    menu_item_info_update_sensitive(m);
+    menu_item_info_update_tooltip(m);
+}
+
+/* A server and the sinks and sources on it share a single probe */
+static void probe_cb(pa_prober *p, const char *server, pa_probe_state_t state, pa_usec_t rtt, void *userdata) {
+    struct probe_result r;
+
+    r.server = server;
+    r.state = state;
+    r.rtt = rtt;
+
+    g_hash_table_foreach(server_hash_table, (GHFunc) update_probe_result, &r);
+    g_hash_table_foreach(sink_hash_table, (GHFunc) update_probe_result, &r);
+    g_hash_table_foreach(source_hash_table, (GHFunc) update_probe_result, &r);
+}
+
 static void update_no_devices_menu_items(void) {
     if (g_hash_table_size(server_hash_table) == 0)
         gtk_widget_show_all(no_servers_menu_item);
@@ -322,18 +1605,46 @@ static void update_no_devices_menu_items(void) {
         gtk_widget_hide(no_sinks_menu_item);
 }
 
-static void browse_cb(pa_browser *z, pa_browse_opcode_t c, const pa_browse_info *i, void *userdata) {
+static void refresh_host(const gchar *key, struct menu_host *host) {
+    menu_window_refresh(&host->window);
+}
+
+static gboolean menu_refresh_cb(gpointer userdata) {
+    menu_refresh_source = 0;
+    menu_refreshes++;
+
+    g_hash_table_foreach(server_hosts.hosts, (GHFunc) refresh_host, NULL);
+    g_hash_table_foreach(sink_hosts.hosts, (GHFunc) refresh_host, NULL);
+    g_hash_table_foreach(source_hosts.hosts, (GHFunc) refresh_host, NULL);
+
+    update_no_devices_menu_items();
+    look_for_current_menu_items();
+    search_refresh();
+
+    return FALSE;
+}
+
+/* However many events come in, the menus are refreshed only once
+ * before we go idle */
+static void schedule_menu_refresh(void) {
+    menu_refresh_requests++;
+
+    if (!menu_refresh_source)
+        menu_refresh_source = g_idle_add_full(MENU_REFRESH_PRIORITY, menu_refresh_cb, NULL, NULL);
+}
+
+static void handle_browse_event(pa_browse_opcode_t c, const pa_browse_info *i) {
     switch (c) {
         case PA_BROWSE_NEW_SERVER:
-            add_menu_item_info(server_hash_table, server_submenu, i, (GCallback) server_change_cb);
+            add_menu_item_info(server_hash_table, server_index, &server_hosts, i);
             break;
 
         case PA_BROWSE_NEW_SINK:
-            add_menu_item_info(sink_hash_table, sink_submenu, i, (GCallback) sink_change_cb);
+            add_menu_item_info(sink_hash_table, sink_index, &sink_hosts, i);
             break;
 
         case PA_BROWSE_NEW_SOURCE:
-            add_menu_item_info(source_hash_table, source_submenu, i, (GCallback) source_change_cb);
+            add_menu_item_info(source_hash_table, source_index, &source_hosts, i);
             break;
 
         case PA_BROWSE_REMOVE_SERVER:
@@ -347,10 +1658,223 @@ static void browse_cb(pa_browser *z, pa_browse_opcode_t c, const pa_browse_info
         case PA_BROWSE_REMOVE_SOURCE:
             remove_menu_item_info(source_hash_table, i);
             break;
+
+        case PA_BROWSE_UPDATE_SERVER:
+            update_menu_item_info(server_hash_table, server_index, &server_hosts, i);
+            break;
+
+        case PA_BROWSE_UPDATE_SINK:
+            update_menu_item_info(sink_hash_table, sink_index, &sink_hosts, i);
+            break;
+
+        case PA_BROWSE_UPDATE_SOURCE:
+            update_menu_item_info(source_hash_table, source_index, &source_hosts, i);
+            break;
     }
 
-    update_no_devices_menu_items();
-    look_for_current_menu_items();
+    schedule_menu_refresh();
+}
+
+static void handle_browse_batch(const pa_browse_event *events, unsigned n) {
+    struct timeval start, end;
+    unsigned j;
+
+    pa_gettimeofday(&start);
+
+    for (j = 0; j < n; j++)
+        handle_browse_event(events[j].opcode, &events[j].info);
+
+    pa_browse_histogram_add(&menu_latency, pa_timeval_diff(pa_gettimeofday(&end), &start));
+}
+
+static void copy_browse_string(char **p, const char **s) {
+    size_t l;
+
+    if (!*s)
+        return;
+
+    l = strlen(*s) + 1;
+    memcpy(*p, *s, l);
+    *s = *p;
+    *p += l;
+}
+
+static size_t browse_string_size(const char *s) {
+    return s ? strlen(s) + 1 : 0;
+}
+
+/* Runs in the browser thread: copy everything the events point to,
+ * since it belongs to the browser */
+static struct browse_batch *browse_batch_new(const pa_browse_event *events, unsigned n) {
+    struct browse_batch *batch;
+    struct timeval tv;
+    size_t size;
+    char *p;
+    unsigned j;
+
+    size = sizeof(struct browse_batch) + n * (sizeof(pa_browse_event) + sizeof(uint32_t) + sizeof(pa_sample_spec));
+
+    for (j = 0; j < n; j++) {
+        const pa_browse_info *i = &events[j].info;
+
+        size +=
+            browse_string_size(i->name) +
+            browse_string_size(i->server) +
+            browse_string_size(i->server_version) +
+            browse_string_size(i->user_name) +
+            browse_string_size(i->fqdn) +
+            browse_string_size(i->device) +
+            browse_string_size(i->description);
+    }
+
+    batch = g_malloc(size);
+    batch->queued_at = pa_timeval_load(pa_gettimeofday(&tv));
+    batch->n = n;
+    memcpy(batch->events, events, n * sizeof(pa_browse_event));
+
+    p = (char*) (batch->events + n);
+
+    for (j = 0; j < n; j++) {
+        pa_browse_info *i = &batch->events[j].info;
+
+        if (i->cookie) {
+            memcpy(p, i->cookie, sizeof(uint32_t));
+            i->cookie = (uint32_t*) p;
+        }
+        p += sizeof(uint32_t);
+
+        if (i->sample_spec) {
+            memcpy(p, i->sample_spec, sizeof(pa_sample_spec));
+            i->sample_spec = (pa_sample_spec*) p;
+        }
+        p += sizeof(pa_sample_spec);
+    }
+
+    for (j = 0; j < n; j++) {
+        pa_browse_info *i = &batch->events[j].info;
+
+        copy_browse_string(&p, &i->name);
+        copy_browse_string(&p, &i->server);
+        copy_browse_string(&p, &i->server_version);
+        copy_browse_string(&p, &i->user_name);
+        copy_browse_string(&p, &i->fqdn);
+        copy_browse_string(&p, &i->device);
+        copy_browse_string(&p, &i->description);
+    }
+
+    g_assert((size_t) (p - (char*) batch) == size);
+
+    return batch;
+}
+
+/* Runs in the UI thread */
+static gboolean drain_browse_queue(gpointer userdata) {
+    struct browse_batch *batch;
+    struct timeval tv;
+
+    /* Cleared before popping, so that a batch pushed in the meantime
+     * either is popped below or schedules another run */
+    pa_atomic_store(&browse_idle_pending, 0);
+
+    while ((batch = pa_spscq_pop(browse_queue))) {
+        pa_usec_t now = pa_timeval_load(pa_gettimeofday(&tv));
+
+        pa_browse_histogram_add(&handoff_latency, now > batch->queued_at ? now - batch->queued_at : 0);
+        handle_browse_batch(batch->events, batch->n);
+        g_free(batch);
+    }
+
+    return FALSE;
+}
+
+static void browse_retry_cb(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *userdata);
+
+/* Runs in the browser thread: hand over as many batches as the UI has
+ * room for, and wake it up */
+static void flush_browse_backlog(void) {
+    struct browse_batch *batch;
+
+    while ((batch = g_queue_peek_head(browse_backlog))) {
+
+        if (pa_spscq_push(browse_queue, batch) < 0) {
+            pa_mainloop_api *api = pa_threaded_mainloop_get_api(browser_mainloop);
+            struct timeval tv;
+
+            pa_gettimeofday(&tv);
+            pa_timeval_add(&tv, BROWSE_RETRY_USEC);
+
+            if (browse_retry_event)
+                api->time_restart(browse_retry_event, &tv);
+            else
+                browse_retry_event = api->time_new(api, &tv, browse_retry_cb, NULL);
+
+            break;
+        }
+
+        g_queue_pop_head(browse_backlog);
+    }
+
+    if (pa_atomic_cmpxchg(&browse_idle_pending, 0, 1))
+        g_idle_add(drain_browse_queue, NULL);
+}
+
+static void browse_retry_cb(pa_mainloop_api *api, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    api->time_restart(e, NULL);
+    flush_browse_backlog();
+}
+
+/* Runs in the browser thread */
+static void browse_batch_cb(pa_browser *z, const pa_browse_event *events, unsigned n, void *userdata) {
+    g_queue_push_tail(browse_backlog, browse_batch_new(events, n));
+    flush_browse_backlog();
+}
+
+static void dump_histogram(const char *stage, const pa_browse_histogram *h) {
+    g_message("%-8s n=%llu avg=%llu p50<=%llu p95<=%llu p99<=%llu max=%llu",
+              stage,
+              (unsigned long long) h->count,
+              (unsigned long long) (h->count > 0 ? h->sum / h->count : 0),
+              (unsigned long long) pa_browse_histogram_percentile(h, 50),
+              (unsigned long long) pa_browse_histogram_percentile(h, 95),
+              (unsigned long long) pa_browse_histogram_percentile(h, 99),
+              (unsigned long long) h->max);
+}
+
+/* Dump where discovered services spent their time, in usec, and how
+ * often Avahi wakes us up */
+static void dump_latency_cb(pa_mainloop_api *api, pa_signal_event *e, int sig, void *userdata) {
+    pa_browser *b = userdata;
+    pa_browser_stats stats;
+    time_t uptime;
+
+    pa_threaded_mainloop_lock(browser_mainloop);
+    pa_browser_get_stats(b, &stats);
+    pa_threaded_mainloop_unlock(browser_mainloop);
+
+    dump_histogram("queue", &stats.latency[PA_BROWSE_STAGE_QUEUE]);
+    dump_histogram("resolve", &stats.latency[PA_BROWSE_STAGE_RESOLVE]);
+    dump_histogram("deliver", &stats.latency[PA_BROWSE_STAGE_DELIVER]);
+    dump_histogram("handoff", &handoff_latency);
+    dump_histogram("menu", &menu_latency);
+
+    uptime = PA_MAX(time(NULL) - startup_time, (time_t) 1);
+    g_message("avahi    timer wakeups/s=%.2f timeouts/s=%.2f watches/s=%.2f",
+              (double) stats.timer_wakeups / uptime,
+              (double) stats.timeout_callbacks / uptime,
+              (double) stats.watch_callbacks / uptime);
+    g_message("menu     refreshes=%llu requests=%llu",
+              (unsigned long long) menu_refreshes,
+              (unsigned long long) menu_refresh_requests);
+
+    g_mutex_lock(notify_mutex);
+    g_message("notify   requests=%llu stale=%llu",
+              (unsigned long long) notify_requests,
+              (unsigned long long) notify_stale);
+    g_mutex_unlock(notify_mutex);
+    g_message("avahi    objects=%u peak=%u slabs=%u",
+              stats.avahi_objects,
+              stats.peak_avahi_objects,
+              stats.avahi_slabs);
 }
 
 static void tray_icon_on_click(GtkStatusIcon *status_icon, void * user_data) {
@@ -484,13 +2008,13 @@ static void set_server(const char *server) {
         return;
 
     if (!pstrequal(server, current_server))
-        set_props(server, NULL, NULL);
+        set_props(server, preferred_sink(server), NULL);
 
     look_for_current_menu_items();
 }
 
 static void sink_default_cb(void) {
-    set_sink(NULL, NULL);
+    set_sink(NULL, preferred_sink(current_server));
 }
 
 static void source_default_cb(void) {
@@ -554,6 +2078,181 @@ static void server_other_cb(void) {
     set_server(input_dialog("Other Server", "Please enter server name:", current_server));
 }
 
+static const gchar *search_item_kind(const struct menu_item_info *m, GHashTable **table) {
+    if (m->host->hosts == &sink_hosts) {
+        *table = sink_hash_table;
+        return "Sink";
+    } else if (m->host->hosts == &source_hosts) {
+        *table = source_hash_table;
+        return "Source";
+    } else {
+        *table = server_hash_table;
+        return "Server";
+    }
+}
+
+/* List the items that have a word starting with each of the words
+ * typed. Only the entries of the most specific word are looked at. */
+static void search_run(void) {
+    struct search_entry probe;
+    GSequenceIter *i;
+    GHashTable *seen;
+    gchar **words, **w, *longest = NULL;
+    unsigned n = 0;
+
+    search_dirty = FALSE;
+    gtk_list_store_clear(search_store);
+
+    words = search_words(gtk_entry_get_text(GTK_ENTRY(glade_xml_get_widget(glade_xml, "searchEntry"))));
+
+    for (w = words; *w; w++)
+        if (!longest || strlen(*w) > strlen(longest))
+            longest = *w;
+
+    if (!longest) {
+        g_strfreev(words);
+        return;
+    }
+
+    seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+    probe.key = longest;
+    probe.item = NULL;
+
+    for (i = g_sequence_search(search_index, &probe, (GCompareDataFunc) search_entry_compare, &probe);
+         !g_sequence_iter_is_end(i) && n < SEARCH_MAX_RESULTS;
+         i = g_sequence_iter_next(i)) {
+
+        const struct search_entry *e = g_sequence_get(i);
+        struct menu_item_info *m = e->item;
+        GHashTable *table;
+        const gchar *kind;
+        GtkTreeIter iter;
+
+        if (!g_str_has_prefix(e->key, longest))
+            break;
+
+        /* An item may have several words with this prefix */
+        if (g_hash_table_lookup(seen, m))
+            continue;
+
+        g_hash_table_insert(seen, m, m);
+
+        for (w = words; *w; w++)
+            if (*w != longest && !search_item_matches(m, *w))
+                break;
+
+        if (*w)
+            continue;
+
+        kind = search_item_kind(m, &table);
+
+        gtk_list_store_append(search_store, &iter);
+        gtk_list_store_set(search_store, &iter,
+                           SEARCH_COLUMN_KIND, kind,
+                           SEARCH_COLUMN_NAME, m->name,
+                           SEARCH_COLUMN_HOST, m->host->label,
+                           SEARCH_COLUMN_TABLE, table,
+                           -1);
+        n++;
+    }
+
+    g_hash_table_destroy(seen);
+    g_strfreev(words);
+}
+
+/* The items changed, list the matches again if anybody is looking */
+static void search_refresh(void) {
+    if (search_dirty && GTK_WIDGET_VISIBLE(glade_xml_get_widget(glade_xml, "searchWindow")))
+        search_run();
+}
+
+static void search_activate(GtkTreeIter *iter) {
+    struct menu_item_info *m;
+    GHashTable *table;
+    gchar *name;
+
+    gtk_tree_model_get(GTK_TREE_MODEL(search_store), iter,
+                       SEARCH_COLUMN_NAME, &name,
+                       SEARCH_COLUMN_TABLE, &table,
+                       -1);
+
+    /* The item might have gone away since it was listed */
+    if ((m = g_hash_table_lookup(table, name)) && m->server) {
+        if (table == sink_hash_table)
+            sink_change_cb(m);
+        else if (table == source_hash_table)
+            source_change_cb(m);
+        else
+            server_change_cb(m);
+
+        gtk_widget_hide(glade_xml_get_widget(glade_xml, "searchWindow"));
+    }
+
+    g_free(name);
+}
+
+static void search_row_activated_cb(GtkTreeView *view, GtkTreePath *path, GtkTreeViewColumn *column, gpointer userdata) {
+    GtkTreeIter iter;
+
+    if (gtk_tree_model_get_iter(GTK_TREE_MODEL(search_store), &iter, path))
+        search_activate(&iter);
+}
+
+/* Enter picks the first match */
+static void search_entry_activate_cb(GtkEntry *entry, gpointer userdata) {
+    GtkTreeIter iter;
+
+    if (gtk_tree_model_get_iter_first(GTK_TREE_MODEL(search_store), &iter))
+        search_activate(&iter);
+}
+
+static void search_entry_changed_cb(GtkEditable *editable, gpointer userdata) {
+    search_run();
+}
+
+static gboolean search_key_press_cb(GtkWidget *w, GdkEventKey *event, gpointer userdata) {
+    if (event->keyval != GDK_Escape)
+        return FALSE;
+
+    gtk_widget_hide(w);
+    return TRUE;
+}
+
+static void show_search(void) {
+    GtkWidget *w, *entry;
+
+    w = glade_xml_get_widget(glade_xml, "searchWindow");
+    entry = glade_xml_get_widget(glade_xml, "searchEntry");
+
+    search_run();
+
+    gtk_widget_show_all(w);
+    gtk_window_present(GTK_WINDOW(w));
+    gtk_widget_grab_focus(entry);
+    gtk_editable_select_region(GTK_EDITABLE(entry), 0, -1);
+}
+
+static void setup_search(void) {
+    GtkWidget *w, *view, *entry;
+
+    search_store = gtk_list_store_new(SEARCH_N_COLUMNS, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_POINTER);
+
+    view = glade_xml_get_widget(glade_xml, "searchTreeView");
+    gtk_tree_view_set_model(GTK_TREE_VIEW(view), GTK_TREE_MODEL(search_store));
+    gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(view), -1, "Type", gtk_cell_renderer_text_new(), "text", SEARCH_COLUMN_KIND, NULL);
+    gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(view), -1, "Name", gtk_cell_renderer_text_new(), "text", SEARCH_COLUMN_NAME, NULL);
+    gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(view), -1, "Host", gtk_cell_renderer_text_new(), "text", SEARCH_COLUMN_HOST, NULL);
+    g_signal_connect(G_OBJECT(view), "row-activated", G_CALLBACK(search_row_activated_cb), NULL);
+
+    entry = glade_xml_get_widget(glade_xml, "searchEntry");
+    g_signal_connect(G_OBJECT(entry), "changed", G_CALLBACK(search_entry_changed_cb), NULL);
+    g_signal_connect(G_OBJECT(entry), "activate", G_CALLBACK(search_entry_activate_cb), NULL);
+
+    w = glade_xml_get_widget(glade_xml, "searchWindow");
+    g_signal_connect(G_OBJECT(w), "delete-event", G_CALLBACK(gtk_widget_hide_on_delete), NULL);
+    g_signal_connect(G_OBJECT(w), "key-press-event", G_CALLBACK(search_key_press_cb), NULL);
+}
+
 static GtkStatusIcon *create_tray_icon(void) {
     GtkStatusIcon *tray_icon;
 
@@ -598,9 +2297,9 @@ static void append_default_device_menu_items(GtkMenu *m, GtkWidget **empty_menu_
 
     gtk_menu_shell_append(GTK_MENU_SHELL(m), gtk_separator_menu_item_new());
 
-    *default_menu_item = append_radio_menu_item(m, "_Default", TRUE, FALSE);
+    *default_menu_item = insert_radio_menu_item(m, "_Default", TRUE, -1);
     g_signal_connect_swapped(G_OBJECT(*default_menu_item), "activate", default_callback, NULL);
-    *other_menu_item = append_radio_menu_item(m, "_Other...", TRUE, FALSE);
+    *other_menu_item = insert_radio_menu_item(m, "_Other...", TRUE, -1);
     g_signal_connect_swapped(G_OBJECT(*other_menu_item), "activate", other_callback, NULL);
 }
 
@@ -609,7 +2308,6 @@ static GtkMenu *create_menu(void) {
     gchar *c;
 
     menu = GTK_MENU(gtk_menu_new());
-    menu_tooltips = gtk_tooltips_new();
 
     sink_submenu = GTK_MENU(gtk_menu_new());
     source_submenu = GTK_MENU(gtk_menu_new());
@@ -619,9 +2317,16 @@ static GtkMenu *create_menu(void) {
     append_default_device_menu_items(source_submenu, &no_sources_menu_item, &default_source_menu_item, &other_source_menu_item, source_default_cb, source_other_cb);
     append_default_device_menu_items(server_submenu, &no_servers_menu_item, &default_server_menu_item, &other_server_menu_item, server_default_cb, server_other_cb);
 
+    menu_hosts_init(&server_hosts, server_submenu, (GCallback) server_change_cb);
+    menu_hosts_init(&sink_hosts, sink_submenu, (GCallback) sink_change_cb);
+    menu_hosts_init(&source_hosts, source_submenu, (GCallback) source_change_cb);
+
     append_submenu(menu, "Default S_erver", server_submenu, "network-wired");
     append_submenu(menu, "Default S_ink", sink_submenu, "audio-card");
     append_submenu(menu, "Default S_ource", source_submenu, "audio-input-microphone");
+
+    item = append_menuitem(menu, "_Find Device...", "edit-find");
+    g_signal_connect(G_OBJECT(item), "activate", G_CALLBACK(show_search), NULL);
     gtk_menu_shell_append(GTK_MENU_SHELL(menu), gtk_separator_menu_item_new());
 
     item = append_menuitem(menu, "_Manager...", NULL);
@@ -739,6 +2444,8 @@ static void check_button_cb(GtkCheckButton *w, const gchar *key) {
     *ptr = b;
     gconf_client_set_bool(gconf, key, b, NULL);
 
+    resolve_eagerly();
+
     gtk_widget_set_sensitive(glade_xml_get_widget(glade_xml, "startupCheckButton"), notify_on_server_discovery||notify_on_sink_discovery||notify_on_source_discovery);
 }
 
@@ -797,13 +2504,138 @@ static void setup_gconf(void) {
     g_signal_connect(G_OBJECT(start_on_login_check_button), "toggled", G_CALLBACK(start_on_login_cb), NULL);
 }
 
+static void submenu_show_cb(GtkWidget *widget, pa_browser *b) {
+    pa_threaded_mainloop_lock(browser_mainloop);
+    pa_browser_resolve(b, GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(widget), "browse-flags")));
+    pa_threaded_mainloop_unlock(browser_mainloop);
+}
+
+/* Resolve the services listed in a submenu only once it is opened */
+static void resolve_on_show(pa_browser *b, GtkMenu *submenu, pa_browse_flags_t flags) {
+    g_object_set_data(G_OBJECT(submenu), "browse-flags", GUINT_TO_POINTER(flags));
+    g_signal_connect(G_OBJECT(submenu), "show", G_CALLBACK(submenu_show_cb), b);
+}
+
+/* Lists of shell wildcard patterns, see pa_browser_add_filter() */
+static void setup_browser_filters(pa_browser *b) {
+    static const struct {
+        const char *key;
+        pa_browse_filter_field_t field;
+    } filters[] = {
+        { GCONF_PREFIX"/filter_name", PA_BROWSE_FILTER_NAME },
+        { GCONF_PREFIX"/filter_server", PA_BROWSE_FILTER_SERVER },
+        { GCONF_PREFIX"/filter_fqdn", PA_BROWSE_FILTER_FQDN },
+        { GCONF_PREFIX"/filter_device", PA_BROWSE_FILTER_DEVICE },
+        { GCONF_PREFIX"/filter_sample_spec", PA_BROWSE_FILTER_SAMPLE_SPEC }
+    };
+    unsigned k;
+
+    for (k = 0; k < G_N_ELEMENTS(filters); k++) {
+        GSList *l, *i;
+
+        l = gconf_client_get_list(gconf, filters[k].key, GCONF_VALUE_STRING, NULL);
+
+        for (i = l; i; i = i->next) {
+            pa_browser_add_filter(b, PA_BROWSE_FOR_SERVERS|PA_BROWSE_FOR_SINKS|PA_BROWSE_FOR_SOURCES, filters[k].field, i->data);
+            g_free(i->data);
+        }
+
+        g_slist_free(l);
+    }
+}
+
+static void server_info_cb(pa_context *c, const pa_server_info *i, void *userdata) {
+
+    if (i)
+        set_local_sample_spec(&i->sample_spec);
+
+    pa_context_disconnect(c);
+}
+
+static void context_state_cb(pa_context *c, void *userdata) {
+    pa_operation *o;
+
+    switch (pa_context_get_state(c)) {
+        case PA_CONTEXT_READY:
+            if ((o = pa_context_get_server_info(c, server_info_cb, NULL)))
+                pa_operation_unref(o);
+            else
+                pa_context_disconnect(c);
+            break;
+
+        case PA_CONTEXT_FAILED:
+        case PA_CONTEXT_TERMINATED:
+            pa_context_unref(local_context);
+            local_context = NULL;
+            break;
+
+        default:
+            ;
+    }
+}
+
+/* Learn which sample spec local clients play in, either from the
+ * configuration or from the sound server they use by default */
+static void setup_local_sample_spec(pa_mainloop_api *api) {
+    gchar *v;
+    pa_sample_spec ss;
+    char f[32];
+    unsigned channels, rate;
+
+    if ((v = gconf_client_get_string(gconf, GCONF_PREFIX"/sample_spec", NULL))) {
+
+        /* Same format as pa_sample_spec_snprint(), i.e. "s16le 2ch 44100Hz" */
+        if (sscanf(v, "%31s %uch %uHz", f, &channels, &rate) == 3) {
+            ss.format = pa_parse_sample_format(f);
+            ss.channels = (uint8_t) channels;
+            ss.rate = rate;
+
+            if (pa_sample_spec_valid(&ss)) {
+                set_local_sample_spec(&ss);
+                g_free(v);
+                return;
+            }
+        }
+
+        g_warning("Invalid sample spec '%s' in configuration.", v);
+        g_free(v);
+    }
+
+    local_context = pa_context_new(api, "PulseAudio Device Chooser");
+    g_assert(local_context);
+
+    pa_context_set_state_callback(local_context, context_state_cb, NULL);
+
+    if (pa_context_connect(local_context, NULL, PA_CONTEXT_NOAUTOSPAWN, NULL) < 0) {
+        pa_context_unref(local_context);
+        local_context = NULL;
+    }
+}
+
+static void setup_browser_cache(pa_browser *b) {
+    gchar *c;
+
+    mkdir(g_get_user_cache_dir(), 0777);
+    c = g_build_filename(g_get_user_cache_dir(), "padevchooser", NULL);
+    mkdir(c, 0700);
+    g_free(c);
+
+    c = g_build_filename(g_get_user_cache_dir(), "padevchooser", "browser.cache", NULL);
+    pa_browser_set_cache_file(b, c);
+    g_free(c);
+}
+
 int main(int argc, char *argv[]) {
     pa_browser *b = NULL;
     pa_glib_mainloop *m = NULL;
     GnomeProgram *program;
+    const char *error = NULL;
 
     startup_time = time(NULL);
 
+    if (!g_thread_supported())
+        g_thread_init(NULL);
+
     program = gnome_program_init("padevchoose", VERSION,
                                  LIBGNOMEUI_MODULE,
                                  argc, argv,
@@ -818,39 +2650,113 @@ int main(int argc, char *argv[]) {
     server_hash_table = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify) menu_item_info_free);
     sink_hash_table = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify) menu_item_info_free);
     source_hash_table = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify) menu_item_info_free);
+    server_index = g_hash_table_new(g_str_hash, g_str_equal);
+    sink_index = g_hash_table_new(g_str_hash, g_str_equal);
+    source_index = g_hash_table_new(g_str_hash, g_str_equal);
+    search_index = g_sequence_new((GDestroyNotify) search_entry_free);
 
     create_menu();
     update_no_devices_menu_items();
 
     setup_gconf();
+    setup_search();
 
     notify_init("PulseAudio Applet");
+    setup_notify_thread();
 
     get_x11_props();
 
-    if (!(b = pa_browser_new(pa_glib_mainloop_get_api(m)))) {
+    prober = pa_prober_new(pa_glib_mainloop_get_api(m), PROBE_MAX_CONCURRENT, PROBE_TIMEOUT_USEC, PROBE_INTERVAL_USEC);
+    pa_prober_set_callback(prober, probe_cb, NULL);
+
+    setup_local_sample_spec(pa_glib_mainloop_get_api(m));
+
+    /* Avahi and the browser live in a thread of their own, the UI only
+     * gets to see the results */
+    browser_mainloop = pa_threaded_mainloop_new();
+    g_assert(browser_mainloop);
+    browse_queue = pa_spscq_new(BROWSE_QUEUE_SIZE);
+    browse_backlog = g_queue_new();
+
+    /* A missing Avahi daemon is not fatal, the browser waits for it.
+     * This only fails if Avahi is running but refuses to browse. */
+    if (!(b = pa_browser_new_full(pa_threaded_mainloop_get_api(browser_mainloop), PA_BROWSE_FOR_SERVERS|PA_BROWSE_FOR_SINKS|PA_BROWSE_FOR_SOURCES|PA_BROWSE_TRACK_UPDATES|PA_BROWSE_LAZY_RESOLVE, 0, &error))) {
         GtkWidget *dialog;
 
         dialog = gtk_message_dialog_new(NULL,
                                         GTK_DIALOG_MODAL,
                                         GTK_MESSAGE_ERROR,
                                         GTK_BUTTONS_CLOSE,
-                                        "The Avahi Zeroconf service is not running. Please make sure that Avahi is installed and activated before starting the PulseAudio Device Chooser.");
+                                        "Failed to browse for PulseAudio services with Avahi: %s",
+                                        error ? error : "Unknown error");
         gtk_window_set_title(GTK_WINDOW(dialog), "Error");
         gtk_dialog_run(GTK_DIALOG(dialog));
         gtk_widget_destroy(dialog);
         goto fail;
     }
 
-    pa_browser_set_callback(b, browse_cb, NULL);
+    pa_browser_set_timer_slack(b, BROWSE_TIMER_SLACK_USEC);
+    setup_browser_filters(b);
+    setup_browser_cache(b);
+    pa_browser_set_batch_callback(b, browse_batch_cb, BROWSE_BATCH_WINDOW_USEC, NULL);
+
+    pa_signal_init(pa_glib_mainloop_get_api(m));
+    pa_signal_new(SIGUSR1, dump_latency_cb, b);
+
+    resolve_on_show(b, server_submenu, PA_BROWSE_FOR_SERVERS);
+    resolve_on_show(b, sink_submenu, PA_BROWSE_FOR_SINKS);
+    resolve_on_show(b, source_submenu, PA_BROWSE_FOR_SOURCES);
+
+    browser = b;
+    resolve_eagerly();
+
+    if (pa_threaded_mainloop_start(browser_mainloop) < 0) {
+        g_warning("Failed to start browser thread.");
+        goto fail;
+    }
 
     tray_icon = create_tray_icon();
 
     gtk_main();
 
 fail:
-    if (b)
+    if (menu_refresh_source)
+        g_source_remove(menu_refresh_source);
+
+    if (browser_mainloop)
+        pa_threaded_mainloop_stop(browser_mainloop);
+
+    browser = NULL;
+
+    if (b) {
+        pa_signal_done();
         pa_browser_unref(b);
+    }
+
+    if (browse_retry_event)
+        pa_threaded_mainloop_get_api(browser_mainloop)->time_free(browse_retry_event);
+
+    if (browse_backlog) {
+        g_queue_foreach(browse_backlog, (GFunc) g_free, NULL);
+        g_queue_free(browse_backlog);
+    }
+
+    if (browse_queue)
+        pa_spscq_free(browse_queue, g_free);
+
+    if (browser_mainloop)
+        pa_threaded_mainloop_free(browser_mainloop);
+
+    if (prober) {
+        pa_prober_free(prober);
+        prober = NULL;
+    }
+
+    if (local_context) {
+        pa_context_set_state_callback(local_context, NULL, NULL);
+        pa_context_disconnect(local_context);
+        pa_context_unref(local_context);
+    }
 
     if (m)
         pa_glib_mainloop_free(m);
@@ -862,10 +2768,28 @@ fail:
     if (source_hash_table)
         g_hash_table_destroy(source_hash_table);
 
-    if (notification)
-        g_object_unref(G_OBJECT(notification));
+    if (server_index)
+        g_hash_table_destroy(server_index);
+    if (sink_index)
+        g_hash_table_destroy(sink_index);
+    if (source_index)
+        g_hash_table_destroy(source_index);
+
+    menu_hosts_done(&server_hosts);
+    menu_hosts_done(&sink_hosts);
+    menu_hosts_done(&source_hosts);
+
+    if (search_index)
+        g_sequence_free(search_index);
+
+    if (search_store)
+        g_object_unref(search_store);
+
+    if (notify_source)
+        g_source_remove(notify_source);
 
-    g_free(last_events);
+    shutdown_notify_thread();
+    notify_ring_clear();
 
     if (program)
         g_object_unref(program);
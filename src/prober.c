@@ -0,0 +1,440 @@
+/***
+  This file is part of padevchooser.
+
+  padevchooser is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  padevchooser is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with padevchooser; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <pulse/xmalloc.h>
+#include <pulse/timeval.h>
+
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+#include <pulsecore/hashmap.h>
+#include <pulsecore/idxset.h>
+#include <pulsecore/llist.h>
+
+#include "prober.h"
+
+struct target {
+    pa_prober *prober;
+    char *server;
+    unsigned ref;
+
+    struct sockaddr_storage sa;
+    socklen_t sa_len;
+
+    /* While a probe is in flight fd is valid and time_event is its
+     * timeout, otherwise time_event schedules the next probe */
+    int fd;
+    pa_io_event *io_event;
+    pa_time_event *time_event;
+    pa_usec_t started;
+
+    pa_bool_t queued;
+    pa_bool_t notify_pending;
+    pa_probe_state_t state;
+    pa_usec_t rtt;
+
+    PA_LLIST_FIELDS(struct target);
+};
+
+struct pa_prober {
+    pa_mainloop_api *mainloop;
+    pa_hashmap *targets;
+
+    unsigned max_probes, n_probes;
+    pa_usec_t timeout, interval;
+
+    PA_LLIST_HEAD(struct target, queue);
+    struct target *queue_tail;
+
+    pa_prober_cb_t callback;
+    void *userdata;
+};
+
+static void dispatch_probes(pa_prober *p);
+
+static pa_usec_t now_usec(void) {
+    struct timeval tv;
+
+    return pa_timeval_load(pa_gettimeofday(&tv));
+}
+
+/* Parse what pa_browser makes of a resolved service, i.e.
+ * "tcp:<ipv4>:<port>" or "tcp6:<ipv6>:<port>", optionally followed
+ * by the host name as a second server to try */
+static int parse_server(const char *server, struct sockaddr_storage *sa, socklen_t *sa_len) {
+    char a[64], *e, *s;
+    unsigned long port;
+    size_t l;
+    int family;
+
+    if (strncmp(server, "tcp:", 4) == 0) {
+        family = AF_INET;
+        server += 4;
+    } else if (strncmp(server, "tcp6:", 5) == 0) {
+        family = AF_INET6;
+        server += 5;
+    } else
+        return -1;
+
+    l = strcspn(server, " \t");
+    if (l >= sizeof(a))
+        return -1;
+
+    memcpy(a, server, l);
+    a[l] = 0;
+
+    if (!(e = strrchr(a, ':')))
+        return -1;
+
+    *(e++) = 0;
+    port = strtoul(e, &s, 10);
+    if (!*e || *s || port <= 0 || port > 0xFFFF)
+        return -1;
+
+    s = a;
+    if (*s == '[' && e - a >= 3 && e[-2] == ']') {
+        e[-2] = 0;
+        s++;
+    }
+
+    memset(sa, 0, sizeof(*sa));
+
+    if (family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in*) sa;
+
+        if (inet_pton(AF_INET, s, &in->sin_addr) <= 0)
+            return -1;
+
+        in->sin_family = AF_INET;
+        in->sin_port = htons((uint16_t) port);
+        *sa_len = sizeof(*in);
+    } else {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6*) sa;
+
+        if (inet_pton(AF_INET6, s, &in6->sin6_addr) <= 0)
+            return -1;
+
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons((uint16_t) port);
+        *sa_len = sizeof(*in6);
+    }
+
+    return 0;
+}
+
+static void target_enqueue(struct target *t) {
+    pa_prober *p = t->prober;
+
+    pa_assert(!t->queued);
+    pa_assert(t->fd < 0);
+
+    PA_LLIST_INSERT_AFTER(struct target, p->queue, p->queue_tail, t);
+    p->queue_tail = t;
+    t->queued = TRUE;
+}
+
+static void target_dequeue(struct target *t) {
+    pa_prober *p = t->prober;
+
+    pa_assert(t->queued);
+
+    if (p->queue_tail == t)
+        p->queue_tail = t->prev;
+
+    PA_LLIST_REMOVE(struct target, p->queue, t);
+    t->queued = FALSE;
+}
+
+static void set_timer(struct target *t, pa_usec_t usec) {
+    struct timeval tv;
+
+    pa_timeval_store(&tv, now_usec() + usec);
+    t->prober->mainloop->time_restart(t->time_event, &tv);
+}
+
+/* Close the connection attempt, if there is one */
+static void probe_stop(struct target *t) {
+    pa_prober *p = t->prober;
+
+    if (t->io_event) {
+        p->mainloop->io_free(t->io_event);
+        t->io_event = NULL;
+    }
+
+    if (t->fd >= 0) {
+        close(t->fd);
+        t->fd = -1;
+
+        pa_assert(p->n_probes >= 1);
+        p->n_probes--;
+    }
+}
+
+static void probe_result(struct target *t, pa_bool_t reachable) {
+
+    if (reachable) {
+        t->state = PA_PROBE_REACHABLE;
+        t->rtt = now_usec() - t->started;
+    } else
+        t->state = PA_PROBE_UNREACHABLE;
+
+    probe_stop(t);
+    set_timer(t, t->prober->interval);
+}
+
+static void notify(struct target *t) {
+    pa_prober *p = t->prober;
+
+    /* The callback might remove the target, don't touch it afterwards */
+    if (p->callback)
+        p->callback(p, t->server, t->state, t->rtt, p->userdata);
+}
+
+static void io_cb(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata) {
+    struct target *t = userdata;
+    pa_prober *p;
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    pa_assert(t);
+    pa_assert(t->fd == fd);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+        error = errno;
+
+    p = t->prober;
+    probe_result(t, error == 0);
+    notify(t);
+    dispatch_probes(p);
+}
+
+static void time_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    struct target *t = userdata;
+    pa_prober *p;
+
+    pa_assert(t);
+
+    p = t->prober;
+
+    if (t->notify_pending) {
+        t->notify_pending = FALSE;
+        set_timer(t, p->interval);
+        notify(t);
+    } else if (t->fd >= 0) {
+        /* Timed out */
+        probe_result(t, FALSE);
+        notify(t);
+        dispatch_probes(p);
+    } else if (!t->queued) {
+        target_enqueue(t);
+        dispatch_probes(p);
+    }
+}
+
+/* Returns 1 if connected right away, 0 if the connection is in
+ * progress and -1 if it failed right away */
+static int probe_start(struct target *t) {
+    pa_prober *p = t->prober;
+    int fd;
+
+    pa_assert(t->fd < 0);
+
+    t->started = now_usec();
+
+    if ((fd = socket(t->sa.ss_family, SOCK_STREAM, 0)) < 0) {
+        pa_log("socket(): %s", strerror(errno));
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    t->fd = fd;
+    p->n_probes++;
+
+    if (connect(fd, (struct sockaddr*) &t->sa, t->sa_len) >= 0)
+        /* Connections to this host may succeed right away */
+        return 1;
+
+    if (errno != EINPROGRESS)
+        return -1;
+
+    t->io_event = p->mainloop->io_new(p->mainloop, fd, PA_IO_EVENT_OUTPUT, io_cb, t);
+    set_timer(t, p->timeout);
+
+    return 0;
+}
+
+static void dispatch_probes(pa_prober *p) {
+    struct target *t;
+
+    while (p->n_probes < p->max_probes && (t = p->queue)) {
+        int r;
+
+        target_dequeue(t);
+
+        /* Report results we got right away from the main loop, so that
+         * the callback is never called from within pa_prober_add() */
+        if ((r = probe_start(t)) != 0) {
+            probe_result(t, r > 0);
+            t->notify_pending = TRUE;
+            set_timer(t, 0);
+        }
+    }
+}
+
+static void target_free(struct target *t) {
+    pa_prober *p = t->prober;
+
+    if (t->queued)
+        target_dequeue(t);
+
+    probe_stop(t);
+    p->mainloop->time_free(t->time_event);
+
+    pa_xfree(t->server);
+    pa_xfree(t);
+}
+
+pa_prober *pa_prober_new(pa_mainloop_api *api, unsigned max_probes, pa_usec_t timeout, pa_usec_t interval) {
+    pa_prober *p;
+
+    pa_assert(api);
+    pa_assert(max_probes > 0);
+
+    p = pa_xnew(pa_prober, 1);
+    p->mainloop = api;
+    p->targets = pa_hashmap_new(pa_idxset_string_hash_func, pa_idxset_string_compare_func);
+    p->max_probes = max_probes;
+    p->n_probes = 0;
+    p->timeout = timeout;
+    p->interval = interval;
+    PA_LLIST_HEAD_INIT(struct target, p->queue);
+    p->queue_tail = NULL;
+    p->callback = NULL;
+    p->userdata = NULL;
+
+    return p;
+}
+
+void pa_prober_free(pa_prober *p) {
+    struct target *t;
+
+    pa_assert(p);
+
+    while ((t = pa_hashmap_steal_first(p->targets)))
+        target_free(t);
+
+    pa_hashmap_free(p->targets, NULL, NULL);
+    pa_xfree(p);
+}
+
+void pa_prober_set_callback(pa_prober *p, pa_prober_cb_t cb, void *userdata) {
+    pa_assert(p);
+
+    p->callback = cb;
+    p->userdata = userdata;
+}
+
+int pa_prober_add(pa_prober *p, const char *server) {
+    struct target *t;
+
+    pa_assert(p);
+    pa_assert(server);
+
+    if ((t = pa_hashmap_get(p->targets, server))) {
+        t->ref++;
+        return 0;
+    }
+
+    t = pa_xnew(struct target, 1);
+
+    if (parse_server(server, &t->sa, &t->sa_len) < 0) {
+        pa_xfree(t);
+        return -1;
+    }
+
+    t->prober = p;
+    t->server = pa_xstrdup(server);
+    t->ref = 1;
+    t->fd = -1;
+    t->io_event = NULL;
+    t->time_event = p->mainloop->time_new(p->mainloop, NULL, time_cb, t);
+    t->started = 0;
+    t->queued = FALSE;
+    t->notify_pending = FALSE;
+    t->state = PA_PROBE_UNKNOWN;
+    t->rtt = 0;
+    PA_LLIST_INIT(struct target, t);
+
+    pa_hashmap_put(p->targets, t->server, t);
+
+    target_enqueue(t);
+    dispatch_probes(p);
+
+    return 0;
+}
+
+void pa_prober_remove(pa_prober *p, const char *server) {
+    struct target *t;
+
+    pa_assert(p);
+    pa_assert(server);
+
+    if (!(t = pa_hashmap_get(p->targets, server)))
+        return;
+
+    pa_assert(t->ref >= 1);
+
+    if (--t->ref > 0)
+        return;
+
+    pa_hashmap_remove(p->targets, t->server);
+    target_free(t);
+
+    dispatch_probes(p);
+}
+
+pa_probe_state_t pa_prober_get(pa_prober *p, const char *server, pa_usec_t *rtt) {
+    struct target *t;
+
+    pa_assert(p);
+    pa_assert(server);
+
+    if (!(t = pa_hashmap_get(p->targets, server)))
+        return PA_PROBE_UNKNOWN;
+
+    if (rtt)
+        *rtt = t->rtt;
+
+    return t->state;
+}
@@ -0,0 +1,60 @@
+#ifndef fooproberhfoo
+#define fooproberhfoo
+
+/***
+  This file is part of padevchooser.
+
+  padevchooser is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  padevchooser is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with padevchooser; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#include <pulse/mainloop-api.h>
+#include <pulse/sample.h>
+
+/* Checks whether discovered servers accept TCP connections from this
+ * host, and how long the handshake takes. Servers are identified by
+ * the "tcp:" and "tcp6:" strings pa_browser hands out. Only the
+ * address is probed, not the host name that may follow it. */
+
+typedef struct pa_prober pa_prober;
+
+typedef enum pa_probe_state {
+    PA_PROBE_UNKNOWN,
+    PA_PROBE_REACHABLE,
+    PA_PROBE_UNREACHABLE
+} pa_probe_state_t;
+
+/* Called from the main loop each time a probe of server finished. rtt
+ * is only valid if the server is reachable. */
+typedef void (*pa_prober_cb_t)(pa_prober *p, const char *server, pa_probe_state_t state, pa_usec_t rtt, void *userdata);
+
+/* At most max_probes connections are attempted at the same time, each
+ * is given up after timeout usecs, and every server is probed again
+ * interval usecs after its last probe finished */
+pa_prober *pa_prober_new(pa_mainloop_api *api, unsigned max_probes, pa_usec_t timeout, pa_usec_t interval);
+void pa_prober_free(pa_prober *p);
+
+void pa_prober_set_callback(pa_prober *p, pa_prober_cb_t cb, void *userdata);
+
+/* Start probing server, if it isn't probed already. Every call needs
+ * to be paired with a pa_prober_remove(). Returns a negative value if
+ * server is not a TCP address. */
+int pa_prober_add(pa_prober *p, const char *server);
+void pa_prober_remove(pa_prober *p, const char *server);
+
+/* Return the result of the last probe of server */
+pa_probe_state_t pa_prober_get(pa_prober *p, const char *server, pa_usec_t *rtt);
+
+#endif
@@ -23,19 +23,134 @@
 #include <config.h>
 #endif
 
+#include <string.h>
+
 #include <pulse/timeval.h>
 #include <pulse/xmalloc.h>
 
 #include <pulsecore/log.h>
 #include <pulsecore/macro.h>
+#include <pulsecore/llist.h>
 
 #include "avahi-wrap.h"
 
+/* Avahi timeouts are kept in a hashed timer wheel of this many slots.
+ * Deadlines are rounded up to multiples of the slack, so that all
+ * timeouts within one tick of the wheel are handled by one wakeup of
+ * the single main loop timer. */
+#define WHEEL_SLOTS 256
+#define DEFAULT_SLACK_USEC (10*PA_USEC_PER_MSEC)
+
+/* Slot number of timeouts that are due and waiting for dispatch */
+#define SLOT_EXPIRED WHEEL_SLOTS
+
+/* Watches and timeouts come and go with every resolver. They are
+ * carved out of slabs of this many objects and recycled through a free
+ * list, which is only given back to the heap with the poll object. */
+#define SLAB_OBJECTS 64
+
+struct slab {
+    struct slab *next;
+    uint64_t align;
+};
+
+struct free_object {
+    struct free_object *next;
+};
+
+typedef struct pool {
+    size_t size;
+    struct slab *slabs;
+    struct free_object *free_list;
+    unsigned n_slabs;
+    unsigned n_live;
+    unsigned n_peak;
+} pool;
+
 typedef struct {
     AvahiPoll api;
     pa_mainloop_api *mainloop;
+
+    pa_usec_t slack;
+    PA_LLIST_HEAD(AvahiTimeout, slots[WHEEL_SLOTS]);
+    PA_LLIST_HEAD(AvahiTimeout, expired);
+    uint64_t current_tick;
+
+    pa_time_event *time_event;
+    pa_bool_t armed;
+    uint64_t armed_tick;
+
+    pool watch_pool;
+    pool timeout_pool;
+
+    pa_avahi_poll_stats stats;
 } pa_avahi_poll;
 
+static void pool_init(pool *l, size_t size) {
+
+    /* Keep every object in a slab aligned for its 64bit members */
+    size = PA_MAX(size, sizeof(struct free_object));
+    l->size = ((size + sizeof(uint64_t) - 1) / sizeof(uint64_t)) * sizeof(uint64_t);
+    l->slabs = NULL;
+    l->free_list = NULL;
+    l->n_slabs = l->n_live = l->n_peak = 0;
+}
+
+static void pool_done(pool *l) {
+    struct slab *s;
+
+    if (l->n_live > 0)
+        pa_log_warn("%u objects still in use when freeing pool.", l->n_live);
+
+    while ((s = l->slabs)) {
+        l->slabs = s->next;
+        pa_xfree(s);
+    }
+
+    l->free_list = NULL;
+    l->n_slabs = 0;
+}
+
+static void* pool_alloc(pool *l) {
+    struct free_object *o;
+
+    if (!l->free_list) {
+        struct slab *s;
+        uint8_t *d;
+        unsigned k;
+
+        s = pa_xmalloc(sizeof(struct slab) + SLAB_OBJECTS * l->size);
+        s->next = l->slabs;
+        l->slabs = s;
+        l->n_slabs++;
+
+        d = (uint8_t*) s + sizeof(struct slab);
+        for (k = 0; k < SLAB_OBJECTS; k++) {
+            o = (struct free_object*) (d + k * l->size);
+            o->next = l->free_list;
+            l->free_list = o;
+        }
+    }
+
+    o = l->free_list;
+    l->free_list = o->next;
+
+    if (++l->n_live > l->n_peak)
+        l->n_peak = l->n_live;
+
+    return o;
+}
+
+static void pool_free(pool *l, void *p) {
+    struct free_object *o = p;
+
+    pa_assert(l->n_live >= 1);
+    l->n_live--;
+
+    o->next = l->free_list;
+    l->free_list = o;
+}
+
 struct AvahiWatch {
     pa_io_event *io_event;
     pa_avahi_poll *avahi_poll;
@@ -67,6 +182,8 @@ static void watch_callback(pa_mainloop_api*a, pa_io_event* e, int fd, pa_io_even
     pa_assert(e);
     pa_assert(w);
 
+    w->avahi_poll->stats.watch_callbacks++;
+
     w->current_event = translate_io_flags_back(events);
     w->callback(w, fd, w->current_event, w->userdata);
     w->current_event = 0;
@@ -81,7 +198,7 @@ static AvahiWatch* watch_new(const AvahiPoll *api, int fd, AvahiWatchEvent event
     pa_assert(callback);
     pa_assert_se(p = api->userdata);
 
-    w = pa_xnew(AvahiWatch, 1);
+    w = pool_alloc(&p->watch_pool);
     w->avahi_poll = p;
     w->current_event = 0;
     w->callback = callback;
@@ -107,23 +224,169 @@ static void watch_free(AvahiWatch *w) {
     pa_assert(w);
 
     w->avahi_poll->mainloop->io_free(w->io_event);
-    pa_xfree(w);
+    pool_free(&w->avahi_poll->watch_pool, w);
 }
 
 struct AvahiTimeout {
-    pa_time_event *time_event;
     pa_avahi_poll *avahi_poll;
     AvahiTimeoutCallback callback;
     void *userdata;
+
+    /* -1 while disabled */
+    int slot;
+    pa_usec_t deadline;
+    uint64_t tick;
+
+    PA_LLIST_FIELDS(AvahiTimeout);
 };
 
-static void timeout_callback(pa_mainloop_api*a, pa_time_event* e, const struct timeval *t, void *userdata) {
-    AvahiTimeout *to = userdata;
+static void wheel_callback(pa_mainloop_api*a, pa_time_event* e, const struct timeval *tv, void *userdata);
+
+static pa_usec_t now_usec(void) {
+    struct timeval tv;
+
+    return pa_timeval_load(pa_gettimeofday(&tv));
+}
+
+static void arm(pa_avahi_poll *p, uint64_t tick) {
+    struct timeval tv;
+
+    pa_timeval_store(&tv, tick * p->slack);
+
+    if (p->time_event)
+        p->mainloop->time_restart(p->time_event, &tv);
+    else
+        p->time_event = p->mainloop->time_new(p->mainloop, &tv, wheel_callback, p);
+
+    p->armed = TRUE;
+    p->armed_tick = tick;
+}
+
+static void disarm(pa_avahi_poll *p) {
+
+    if (p->armed)
+        p->mainloop->time_restart(p->time_event, NULL);
+
+    p->armed = FALSE;
+}
+
+/* Arm the timer for the earliest timeout. Those are in the slots
+ * directly ahead of the current tick, unless no timeout is due within
+ * one revolution of the wheel. */
+static void rearm(pa_avahi_poll *p) {
+    uint64_t min = 0;
+    pa_bool_t found = FALSE;
+    unsigned d;
+
+    if (p->stats.n_timeouts <= 0) {
+        disarm(p);
+        return;
+    }
+
+    for (d = 0; d < WHEEL_SLOTS; d++) {
+        AvahiTimeout *t;
+
+        for (t = p->slots[(p->current_tick + d) % WHEEL_SLOTS]; t; t = t->next) {
+            if (t->tick == p->current_tick + d) {
+                arm(p, t->tick);
+                return;
+            }
+
+            if (!found || t->tick < min) {
+                min = t->tick;
+                found = TRUE;
+            }
+        }
+    }
+
+    pa_assert(found);
+    arm(p, min);
+}
+
+static void timeout_unlink(AvahiTimeout *t) {
+    pa_avahi_poll *p = t->avahi_poll;
+
+    if (t->slot == SLOT_EXPIRED)
+        PA_LLIST_REMOVE(AvahiTimeout, p->expired, t);
+    else if (t->slot >= 0) {
+        PA_LLIST_REMOVE(AvahiTimeout, p->slots[t->slot], t);
+        pa_assert(p->stats.n_timeouts >= 1);
+        p->stats.n_timeouts--;
+    }
+
+    t->slot = -1;
+}
+
+/* Whether the timer may be armed for t. If t goes away or moves, the
+ * timer has to be armed for whatever is due next instead. */
+static pa_bool_t timeout_is_next(AvahiTimeout *t) {
+    pa_avahi_poll *p = t->avahi_poll;
+
+    return p->armed && t->slot >= 0 && t->slot != SLOT_EXPIRED && t->tick == p->armed_tick;
+}
+
+static void timeout_link(AvahiTimeout *t, pa_usec_t deadline) {
+    pa_avahi_poll *p = t->avahi_poll;
+
+    /* Round up, a timeout must never fire early */
+    t->deadline = deadline;
+    t->tick = (deadline + p->slack - 1) / p->slack;
+
+    /* Slots behind the current tick won't be looked at again for a
+     * full revolution */
+    if (t->tick < p->current_tick)
+        t->tick = p->current_tick;
+
+    t->slot = (int) (t->tick % WHEEL_SLOTS);
+    PA_LLIST_PREPEND(AvahiTimeout, p->slots[t->slot], t);
+    p->stats.n_timeouts++;
+
+    if (!p->armed || t->tick < p->armed_tick)
+        arm(p, t->tick);
+}
+
+static void wheel_callback(pa_mainloop_api*a, pa_time_event* e, const struct timeval *tv, void *userdata) {
+    pa_avahi_poll *p = userdata;
+    uint64_t now_tick, tick;
+    AvahiTimeout *t;
 
     pa_assert(a);
     pa_assert(e);
+    pa_assert(p);
+
+    p->armed = FALSE;
+    p->stats.wakeups++;
+
+    now_tick = now_usec() / p->slack;
+
+    /* Collect everything that is due before calling anyone, since the
+     * callbacks may add, change or free any timeout */
+    for (tick = p->current_tick; tick <= now_tick && tick < p->current_tick + WHEEL_SLOTS; tick++) {
+        AvahiTimeout *n;
+
+        for (t = p->slots[tick % WHEEL_SLOTS]; t; t = n) {
+            n = t->next;
+
+            if (t->tick > now_tick)
+                continue;
+
+            timeout_unlink(t);
+            t->slot = SLOT_EXPIRED;
+            PA_LLIST_PREPEND(AvahiTimeout, p->expired, t);
+        }
+    }
+
+    if (now_tick >= p->current_tick)
+        p->current_tick = now_tick + 1;
 
-    to->callback(to, to->userdata);
+    /* Like a pa_time_event an Avahi timeout is disabled once it fired */
+    while ((t = p->expired)) {
+        timeout_unlink(t);
+        p->stats.timeout_callbacks++;
+        t->callback(t, t->userdata);
+    }
+
+    rearm(p);
 }
 
 static AvahiTimeout* timeout_new(const AvahiPoll *api, const struct timeval *tv, AvahiTimeoutCallback callback, void *userdata) {
@@ -134,40 +397,51 @@ static AvahiTimeout* timeout_new(const AvahiPoll *api, const struct timeval *tv,
     pa_assert(callback);
     pa_assert_se(p = api->userdata);
 
-    t = pa_xnew(AvahiTimeout, 1);
+    t = pool_alloc(&p->timeout_pool);
     t->avahi_poll = p;
     t->callback = callback;
     t->userdata = userdata;
+    t->slot = -1;
+    PA_LLIST_INIT(AvahiTimeout, t);
 
-    t->time_event = tv ? p->mainloop->time_new(p->mainloop, tv, timeout_callback, t) : NULL;
+    if (tv)
+        timeout_link(t, pa_timeval_load(tv));
 
     return t;
 }
 
 static void timeout_update(AvahiTimeout *t, const struct timeval *tv) {
+    pa_bool_t next;
 
     pa_assert(t);
 
-    if (t->time_event && tv)
-        t->avahi_poll->mainloop->time_restart(t->time_event, tv);
-    else if (!t->time_event && tv)
-        t->time_event = t->avahi_poll->mainloop->time_new(t->avahi_poll->mainloop, tv, timeout_callback, t);
-    else if (t->time_event && !tv) {
-        t->avahi_poll->mainloop->time_free(t->time_event);
-        t->time_event = NULL;
-    }
+    next = timeout_is_next(t);
+    timeout_unlink(t);
+
+    if (tv)
+        timeout_link(t, pa_timeval_load(tv));
+
+    if (next || t->avahi_poll->stats.n_timeouts <= 0)
+        rearm(t->avahi_poll);
 }
 
 static void timeout_free(AvahiTimeout *t) {
+    pa_bool_t next;
+
     pa_assert(t);
 
-    if (t->time_event)
-        t->avahi_poll->mainloop->time_free(t->time_event);
-    pa_xfree(t);
+    next = timeout_is_next(t);
+    timeout_unlink(t);
+
+    if (next || t->avahi_poll->stats.n_timeouts <= 0)
+        rearm(t->avahi_poll);
+
+    pool_free(&t->avahi_poll->timeout_pool, t);
 }
 
 AvahiPoll* pa_avahi_poll_new(pa_mainloop_api *m) {
     pa_avahi_poll *p;
+    unsigned k;
 
     pa_assert(m);
 
@@ -183,6 +457,18 @@ AvahiPoll* pa_avahi_poll_new(pa_mainloop_api *m) {
     p->api.timeout_free = timeout_free;
     p->mainloop = m;
 
+    p->slack = DEFAULT_SLACK_USEC;
+    for (k = 0; k < WHEEL_SLOTS; k++)
+        PA_LLIST_HEAD_INIT(AvahiTimeout, p->slots[k]);
+    PA_LLIST_HEAD_INIT(AvahiTimeout, p->expired);
+    p->current_tick = now_usec() / p->slack;
+    p->time_event = NULL;
+    p->armed = FALSE;
+    p->armed_tick = 0;
+    pool_init(&p->watch_pool, sizeof(AvahiWatch));
+    pool_init(&p->timeout_pool, sizeof(AvahiTimeout));
+    memset(&p->stats, 0, sizeof(p->stats));
+
     return &p->api;
 }
 
@@ -191,6 +477,53 @@ void pa_avahi_poll_free(AvahiPoll *api) {
     pa_assert(api);
     pa_assert_se(p = api->userdata);
 
+    if (p->time_event)
+        p->mainloop->time_free(p->time_event);
+
+    pool_done(&p->watch_pool);
+    pool_done(&p->timeout_pool);
+
     pa_xfree(p);
 }
 
+void pa_avahi_poll_set_slack(AvahiPoll *api, pa_usec_t slack) {
+    pa_avahi_poll *p;
+    AvahiTimeout *pending = NULL, *t;
+    unsigned k;
+
+    pa_assert(api);
+    pa_assert_se(p = api->userdata);
+
+    /* Take all timeouts out of the wheel and put them back in with
+     * the new tick length */
+    for (k = 0; k < WHEEL_SLOTS; k++)
+        while ((t = p->slots[k])) {
+            timeout_unlink(t);
+            PA_LLIST_PREPEND(AvahiTimeout, pending, t);
+        }
+
+    p->slack = PA_MAX(slack, (pa_usec_t) 1);
+    p->current_tick = now_usec() / p->slack;
+    disarm(p);
+
+    while ((t = pending)) {
+        PA_LLIST_REMOVE(AvahiTimeout, pending, t);
+        timeout_link(t, t->deadline);
+    }
+}
+
+void pa_avahi_poll_get_stats(AvahiPoll *api, pa_avahi_poll_stats *stats) {
+    pa_avahi_poll *p;
+
+    pa_assert(api);
+    pa_assert(stats);
+    pa_assert_se(p = api->userdata);
+
+    *stats = p->stats;
+    stats->n_watch_objects = p->watch_pool.n_live;
+    stats->peak_watch_objects = p->watch_pool.n_peak;
+    stats->n_timeout_objects = p->timeout_pool.n_live;
+    stats->peak_timeout_objects = p->timeout_pool.n_peak;
+    stats->n_slabs = p->watch_pool.n_slabs + p->timeout_pool.n_slabs;
+}
+
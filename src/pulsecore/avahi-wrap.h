@@ -26,7 +26,27 @@
 
 #include <pulse/mainloop-api.h>
 
+#include <pulse/sample.h>
+
+typedef struct pa_avahi_poll_stats {
+    uint64_t wakeups;           /* Times the timer of the wheel fired */
+    uint64_t timeout_callbacks; /* Avahi timeouts dispatched */
+    uint64_t watch_callbacks;   /* Avahi watches dispatched */
+    unsigned n_timeouts;        /* Avahi timeouts currently enabled */
+    unsigned n_watch_objects;   /* Avahi watches currently allocated */
+    unsigned peak_watch_objects;
+    unsigned n_timeout_objects; /* Avahi timeouts currently allocated */
+    unsigned peak_timeout_objects;
+    unsigned n_slabs;           /* Slabs both kinds of objects are carved from */
+} pa_avahi_poll_stats;
+
 AvahiPoll* pa_avahi_poll_new(pa_mainloop_api *api);
 void pa_avahi_poll_free(AvahiPoll *p);
 
+/* Timeouts are delayed by up to this many usecs, so that timeouts
+ * close to each other are handled in a single wakeup */
+void pa_avahi_poll_set_slack(AvahiPoll *p, pa_usec_t slack);
+
+void pa_avahi_poll_get_stats(AvahiPoll *p, pa_avahi_poll_stats *stats);
+
 #endif
@@ -0,0 +1,271 @@
+/***
+  This file is part of PulseAudio.
+
+  Copyright 2004-2008 Lennart Poettering
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/idxset.h>
+#include <pulsecore/log.h>
+#include <pulsecore/macro.h>
+
+#include "hashmap.h"
+
+#define INITIAL_BUCKETS 127
+
+struct hashmap_entry {
+    struct hashmap_entry *next, *previous, *bucket_next, *bucket_previous;
+    unsigned hash;
+    const void *key;
+    void *value;
+};
+
+struct pa_hashmap {
+    unsigned size;
+    struct hashmap_entry **data;
+    struct hashmap_entry *first_entry;
+
+    unsigned n_entries;
+    pa_hash_func_t hash_func;
+    pa_compare_func_t compare_func;
+};
+
+pa_hashmap *pa_hashmap_new(pa_hash_func_t hash_func, pa_compare_func_t compare_func) {
+    pa_hashmap *h;
+
+    h = pa_xnew(pa_hashmap, 1);
+    h->data = pa_xnew0(struct hashmap_entry*, h->size = INITIAL_BUCKETS);
+    h->first_entry = NULL;
+    h->n_entries = 0;
+    h->hash_func = hash_func ? hash_func : pa_idxset_trivial_hash_func;
+    h->compare_func = compare_func ? compare_func : pa_idxset_trivial_compare_func;
+
+    return h;
+}
+
+static void remove_entry(pa_hashmap *h, struct hashmap_entry *e) {
+    pa_assert(h);
+    pa_assert(e);
+
+    /* Remove from iteration list */
+    if (e->next)
+        e->next->previous = e->previous;
+    if (e->previous)
+        e->previous->next = e->next;
+    else
+        h->first_entry = e->next;
+
+    /* Remove from hash table bucket list */
+    if (e->bucket_next)
+        e->bucket_next->bucket_previous = e->bucket_previous;
+    if (e->bucket_previous)
+        e->bucket_previous->bucket_next = e->bucket_next;
+    else
+        h->data[e->hash % h->size] = e->bucket_next;
+
+    pa_xfree(e);
+
+    pa_assert(h->n_entries >= 1);
+    h->n_entries--;
+}
+
+void pa_hashmap_free(pa_hashmap*h, void (*free_func)(void *p, void *userdata), void *userdata) {
+    pa_assert(h);
+
+    while (h->first_entry) {
+        if (free_func)
+            free_func(h->first_entry->value, userdata);
+        remove_entry(h, h->first_entry);
+    }
+
+    pa_xfree(h->data);
+    pa_xfree(h);
+}
+
+static struct hashmap_entry *hash_scan(pa_hashmap *h, unsigned hash, const void *key) {
+    struct hashmap_entry *e;
+    pa_assert(h);
+
+    for (e = h->data[hash % h->size]; e; e = e->bucket_next)
+        if (e->hash == hash && h->compare_func(e->key, key) == 0)
+            return e;
+
+    return NULL;
+}
+
+/* Unlike upstream we grow the bucket array once the table gets
+ * denser than one entry per bucket, since the browser keeps a few
+ * thousand services in here on large networks. */
+static void grow(pa_hashmap *h) {
+    struct hashmap_entry *e;
+    unsigned n;
+
+    pa_assert(h);
+
+    n = h->size * 2 + 1;
+    pa_xfree(h->data);
+    h->data = pa_xnew0(struct hashmap_entry*, n);
+    h->size = n;
+
+    for (e = h->first_entry; e; e = e->next) {
+        unsigned i = e->hash % h->size;
+
+        e->bucket_previous = NULL;
+        if ((e->bucket_next = h->data[i]))
+            e->bucket_next->bucket_previous = e;
+        h->data[i] = e;
+    }
+}
+
+int pa_hashmap_put(pa_hashmap *h, const void *key, void *value) {
+    struct hashmap_entry *e;
+    unsigned hash, i;
+
+    pa_assert(h);
+
+    hash = h->hash_func(key);
+
+    if (hash_scan(h, hash, key))
+        return -1;
+
+    if (h->n_entries >= h->size)
+        grow(h);
+
+    e = pa_xnew(struct hashmap_entry, 1);
+    e->hash = hash;
+    e->key = key;
+    e->value = value;
+
+    /* Insert into hash table */
+    i = hash % h->size;
+    e->bucket_next = h->data[i];
+    e->bucket_previous = NULL;
+    if (h->data[i])
+        h->data[i]->bucket_previous = e;
+    h->data[i] = e;
+
+    /* Insert into iteration list */
+    e->previous = NULL;
+    e->next = h->first_entry;
+    if (h->first_entry)
+        h->first_entry->previous = e;
+    h->first_entry = e;
+
+    h->n_entries++;
+    return 0;
+}
+
+void* pa_hashmap_get(pa_hashmap *h, const void *key) {
+    struct hashmap_entry *e;
+
+    pa_assert(h);
+
+    if (!(e = hash_scan(h, h->hash_func(key), key)))
+        return NULL;
+
+    return e->value;
+}
+
+void* pa_hashmap_remove(pa_hashmap *h, const void *key) {
+    struct hashmap_entry *e;
+    void *data;
+
+    pa_assert(h);
+
+    if (!(e = hash_scan(h, h->hash_func(key), key)))
+        return NULL;
+
+    data = e->value;
+    remove_entry(h, e);
+    return data;
+}
+
+void *pa_hashmap_iterate(pa_hashmap *h, void **state, const void **key) {
+    struct hashmap_entry *e;
+
+    pa_assert(h);
+    pa_assert(state);
+
+    if (*state == (void*) -1)
+        goto at_end;
+
+    if (!*state && !h->first_entry)
+        goto at_end;
+
+    e = *state ? *state : h->first_entry;
+
+    if (e->next)
+        *state = e->next;
+    else
+        *state = (void*) -1;
+
+    if (key)
+        *key = e->key;
+
+    return e->value;
+
+at_end:
+    *state = (void *) -1;
+
+    if (key)
+        *key = NULL;
+
+    return NULL;
+}
+
+void* pa_hashmap_steal_first(pa_hashmap *h) {
+    void *data;
+
+    pa_assert(h);
+
+    if (!h->first_entry)
+        return NULL;
+
+    data = h->first_entry->value;
+    remove_entry(h, h->first_entry);
+    return data;
+}
+
+void *pa_hashmap_first(pa_hashmap *h) {
+    pa_assert(h);
+
+    if (!h->first_entry)
+        return NULL;
+
+    return h->first_entry->value;
+}
+
+unsigned pa_hashmap_size(pa_hashmap *h) {
+    pa_assert(h);
+
+    return h->n_entries;
+}
+
+pa_bool_t pa_hashmap_isempty(pa_hashmap *h) {
+    pa_assert(h);
+
+    return h->n_entries == 0;
+}
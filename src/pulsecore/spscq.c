@@ -0,0 +1,107 @@
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pulse/xmalloc.h>
+
+#include <pulsecore/atomic.h>
+#include <pulsecore/macro.h>
+
+#include "spscq.h"
+
+/* The indexes only ever grow and wrap around. Each one is written by
+ * one side only: write_idx by the producer, read_idx by the
+ * consumer. Advancing an index is a full barrier, so the cell is
+ * always written before the consumer can see it, and read before the
+ * producer may reuse it. */
+struct pa_spscq {
+    unsigned size;
+    pa_atomic_t read_idx, write_idx;
+    void **cells;
+};
+
+pa_spscq* pa_spscq_new(unsigned size) {
+    pa_spscq *q;
+    unsigned n = 1;
+
+    pa_assert(size > 0);
+
+    while (n < size)
+        n <<= 1;
+
+    q = pa_xnew(pa_spscq, 1);
+    q->size = n;
+    pa_atomic_store(&q->read_idx, 0);
+    pa_atomic_store(&q->write_idx, 0);
+    q->cells = pa_xnew0(void*, n);
+
+    return q;
+}
+
+void pa_spscq_free(pa_spscq *q, void (*free_func)(void *p)) {
+    void *p;
+
+    pa_assert(q);
+
+    while ((p = pa_spscq_pop(q)))
+        if (free_func)
+            free_func(p);
+
+    pa_xfree(q->cells);
+    pa_xfree(q);
+}
+
+int pa_spscq_push(pa_spscq *q, void *p) {
+    unsigned w, r;
+
+    pa_assert(q);
+    pa_assert(p);
+
+    w = (unsigned) pa_atomic_load(&q->write_idx);
+    r = (unsigned) pa_atomic_load(&q->read_idx);
+
+    if (w - r >= q->size)
+        return -1;
+
+    q->cells[w & (q->size - 1)] = p;
+    pa_atomic_inc(&q->write_idx);
+
+    return 0;
+}
+
+void* pa_spscq_pop(pa_spscq *q) {
+    unsigned w, r;
+    void *p;
+
+    pa_assert(q);
+
+    r = (unsigned) pa_atomic_load(&q->read_idx);
+    w = (unsigned) pa_atomic_load(&q->write_idx);
+
+    if (r == w)
+        return NULL;
+
+    p = q->cells[r & (q->size - 1)];
+    pa_atomic_inc(&q->read_idx);
+
+    return p;
+}
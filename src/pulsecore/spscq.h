@@ -0,0 +1,43 @@
+#ifndef foopulsecorespscqhfoo
+#define foopulsecorespscqhfoo
+
+/***
+  This file is part of PulseAudio.
+
+  PulseAudio is free software; you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation; either version 2.1 of the
+  License, or (at your option) any later version.
+
+  PulseAudio is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with PulseAudio; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+#include <pulsecore/macro.h>
+
+/* A lock-free, fixed size queue of pointers for exactly one producer
+ * thread and one consumer thread. Neither side ever blocks: pushing
+ * to a full queue and popping from an empty queue fail right away. */
+
+typedef struct pa_spscq pa_spscq;
+
+/* Create a new queue. size is rounded up to a power of two */
+pa_spscq* pa_spscq_new(unsigned size);
+
+/* Free the queue. Calls the specified function for every item still in the queue. The function may be NULL */
+void pa_spscq_free(pa_spscq *q, void (*free_func)(void *p));
+
+/* Producer side. Returns negative when the queue is full */
+int pa_spscq_push(pa_spscq *q, void *p);
+
+/* Consumer side. Returns NULL when the queue is empty */
+void* pa_spscq_pop(pa_spscq *q);
+
+#endif
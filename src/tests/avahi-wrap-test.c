@@ -0,0 +1,155 @@
+/***
+  This file is part of padevchooser.
+
+  padevchooser is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  padevchooser is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with padevchooser; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* Checks that the timer wheel of avahi-wrap.c only wakes up for
+ * timeouts that are still due: one that is disabled, freed or moved
+ * further out must not leave the timer armed for its old deadline */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+
+#include <pulse/mainloop.h>
+#include <pulse/timeval.h>
+
+#include <pulsecore/macro.h>
+#include <pulsecore/avahi-wrap.h>
+
+#define EARLY_USEC (50*PA_USEC_PER_MSEC)
+#define LATE_USEC (300*PA_USEC_PER_MSEC)
+#define LATER_USEC (600*PA_USEC_PER_MSEC)
+#define TEST_TIMEOUT_USEC (5*PA_USEC_PER_SEC)
+
+static AvahiPoll *avahi_poll = NULL;
+static pa_bool_t failed = FALSE;
+
+static void check(pa_bool_t ok, const char *what) {
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+
+    if (!ok)
+        failed = TRUE;
+}
+
+static void avahi_timeout_cb(AvahiTimeout *t, void *userdata) {
+    (*(unsigned*) userdata)++;
+}
+
+static AvahiTimeout *new_timeout(pa_usec_t usec, unsigned *fired) {
+    struct timeval tv;
+
+    pa_gettimeofday(&tv);
+    pa_timeval_add(&tv, usec);
+
+    return avahi_poll->timeout_new(avahi_poll, &tv, avahi_timeout_cb, fired);
+}
+
+static void timeout_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    *(pa_bool_t*) userdata = TRUE;
+}
+
+/* Run the main loop until *fired is set or usec have passed, and
+ * return the number of times the wheel woke up meanwhile */
+static uint64_t run(pa_mainloop *m, unsigned *fired, pa_usec_t usec) {
+    pa_mainloop_api *api = pa_mainloop_get_api(m);
+    pa_avahi_poll_stats before, after;
+    pa_time_event *e;
+    struct timeval tv;
+    pa_bool_t timeout = FALSE;
+
+    pa_avahi_poll_get_stats(avahi_poll, &before);
+
+    pa_gettimeofday(&tv);
+    pa_timeval_add(&tv, usec);
+    e = api->time_new(api, &tv, timeout_cb, &timeout);
+
+    while (!timeout && !(fired && *fired))
+        if (pa_mainloop_iterate(m, 1, NULL) < 0)
+            break;
+
+    api->time_free(e);
+
+    pa_avahi_poll_get_stats(avahi_poll, &after);
+
+    return after.wakeups - before.wakeups;
+}
+
+int main(int argc, char *argv[]) {
+    pa_mainloop *m;
+    AvahiTimeout *early, *late;
+    unsigned early_fired = 0, late_fired = 0;
+    struct timeval tv;
+
+    m = pa_mainloop_new();
+    avahi_poll = pa_avahi_poll_new(pa_mainloop_get_api(m));
+
+    /* Disabling the earliest timeout */
+    early = new_timeout(EARLY_USEC, &early_fired);
+    late = new_timeout(LATE_USEC, &late_fired);
+    avahi_poll->timeout_update(early, NULL);
+
+    check(run(m, &late_fired, TEST_TIMEOUT_USEC) == 1, "no wakeup for a disabled timeout");
+    check(late_fired == 1 && early_fired == 0, "only the enabled timeout fired");
+
+    avahi_poll->timeout_free(early);
+    avahi_poll->timeout_free(late);
+    early_fired = late_fired = 0;
+
+    /* Freeing the earliest timeout */
+    early = new_timeout(EARLY_USEC, &early_fired);
+    late = new_timeout(LATE_USEC, &late_fired);
+    avahi_poll->timeout_free(early);
+
+    check(run(m, &late_fired, TEST_TIMEOUT_USEC) == 1, "no wakeup for a freed timeout");
+    check(late_fired == 1 && early_fired == 0, "only the remaining timeout fired");
+
+    avahi_poll->timeout_free(late);
+    early_fired = late_fired = 0;
+
+    /* Moving the earliest timeout behind the other one */
+    early = new_timeout(EARLY_USEC, &early_fired);
+    late = new_timeout(LATE_USEC, &late_fired);
+    pa_gettimeofday(&tv);
+    pa_timeval_add(&tv, LATER_USEC);
+    avahi_poll->timeout_update(early, &tv);
+
+    check(run(m, &late_fired, TEST_TIMEOUT_USEC) == 1, "no wakeup for the old deadline of a moved timeout");
+    check(late_fired == 1 && early_fired == 0, "the timeout that is due first fired first");
+    check(run(m, &early_fired, TEST_TIMEOUT_USEC) == 1, "one wakeup for the new deadline");
+    check(early_fired == 1, "the moved timeout fired");
+
+    avahi_poll->timeout_free(early);
+    avahi_poll->timeout_free(late);
+    early_fired = 0;
+
+    /* Disabling the only timeout there is */
+    early = new_timeout(EARLY_USEC, &early_fired);
+    avahi_poll->timeout_update(early, NULL);
+
+    check(run(m, NULL, LATE_USEC) == 0, "no wakeup without enabled timeouts");
+    check(early_fired == 0, "the disabled timeout didn't fire");
+
+    avahi_poll->timeout_free(early);
+
+    pa_avahi_poll_free(avahi_poll);
+    pa_mainloop_free(m);
+
+    return failed ? 1 : 0;
+}
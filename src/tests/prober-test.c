@@ -0,0 +1,203 @@
+/***
+  This file is part of padevchooser.
+
+  padevchooser is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published
+  by the Free Software Foundation; either version 2 of the License,
+  or (at your option) any later version.
+
+  padevchooser is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with padevchooser; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+  USA.
+***/
+
+/* Probes a local listening socket, which has to be reachable, and a
+ * port nobody listens on, which must not be */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <pulse/mainloop.h>
+#include <pulse/timeval.h>
+
+#include <pulsecore/macro.h>
+
+#include "../prober.h"
+
+#define PROBE_TIMEOUT_USEC (2*PA_USEC_PER_SEC)
+#define PROBE_INTERVAL_USEC (100*PA_USEC_PER_MSEC)
+#define TEST_TIMEOUT_USEC (10*PA_USEC_PER_SEC)
+
+struct result {
+    const char *server;
+    pa_probe_state_t state;
+    pa_usec_t rtt;
+    unsigned n;
+};
+
+static struct result results[3];
+static unsigned n_results = 0;
+static pa_bool_t failed = FALSE;
+
+static void check(pa_bool_t ok, const char *what) {
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+
+    if (!ok)
+        failed = TRUE;
+}
+
+/* Open a TCP socket on a free port of the loopback interface. Returns
+ * the port, or 0 on failure. */
+static uint16_t open_socket(int *fd, pa_bool_t do_listen) {
+    struct sockaddr_in sa;
+    socklen_t l = sizeof(sa);
+
+    if ((*fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(*fd, (struct sockaddr*) &sa, sizeof(sa)) < 0 ||
+        (do_listen && listen(*fd, 8) < 0) ||
+        getsockname(*fd, (struct sockaddr*) &sa, &l) < 0) {
+        close(*fd);
+        return 0;
+    }
+
+    return ntohs(sa.sin_port);
+}
+
+static void probe_cb(pa_prober *p, const char *server, pa_probe_state_t state, pa_usec_t rtt, void *userdata) {
+    unsigned k;
+
+    for (k = 0; k < n_results; k++)
+        if (!strcmp(results[k].server, server)) {
+            results[k].state = state;
+            results[k].rtt = rtt;
+            results[k].n++;
+        }
+}
+
+static void timeout_cb(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata) {
+    *(pa_bool_t*) userdata = TRUE;
+}
+
+/* Run the main loop until every server was probed at least n times */
+static pa_bool_t run(pa_mainloop *m, unsigned n) {
+    pa_mainloop_api *api = pa_mainloop_get_api(m);
+    pa_time_event *e;
+    struct timeval tv;
+    pa_bool_t timeout = FALSE;
+    unsigned k;
+
+    pa_gettimeofday(&tv);
+    pa_timeval_add(&tv, TEST_TIMEOUT_USEC);
+    e = api->time_new(api, &tv, timeout_cb, &timeout);
+
+    while (!timeout) {
+        for (k = 0; k < n_results; k++)
+            if (results[k].n < n)
+                break;
+
+        if (k >= n_results)
+            break;
+
+        if (pa_mainloop_iterate(m, 1, NULL) < 0)
+            break;
+    }
+
+    api->time_free(e);
+
+    return !timeout;
+}
+
+int main(int argc, char *argv[]) {
+    char listening[64], closed[64], named[96];
+    uint16_t port;
+    int listen_fd, closed_fd;
+    pa_mainloop *m;
+    pa_prober *p;
+    pa_usec_t rtt;
+
+    if (!(port = open_socket(&listen_fd, TRUE))) {
+        perror("listening socket");
+        return 1;
+    }
+
+    snprintf(listening, sizeof(listening), "tcp:127.0.0.1:%u", port);
+
+    /* The server strings pa_browser makes carry the host name */
+    snprintf(named, sizeof(named), "tcp:127.0.0.1:%u somehost.local", port);
+
+    /* Bound, but nobody listens, so connecting is refused */
+    if (!(port = open_socket(&closed_fd, FALSE))) {
+        perror("closed socket");
+        return 1;
+    }
+
+    snprintf(closed, sizeof(closed), "tcp:127.0.0.1:%u", port);
+
+    m = pa_mainloop_new();
+    p = pa_prober_new(pa_mainloop_get_api(m), 2, PROBE_TIMEOUT_USEC, PROBE_INTERVAL_USEC);
+    pa_prober_set_callback(p, probe_cb, NULL);
+
+    check(pa_prober_add(p, "unix:/tmp/pulse/native") < 0, "non-TCP servers are refused");
+    check(pa_prober_add(p, "tcp:localhost") < 0, "servers without a port are refused");
+
+    results[n_results++].server = listening;
+    results[n_results++].server = named;
+    results[n_results++].server = closed;
+
+    check(pa_prober_add(p, listening) >= 0, "listening socket added");
+    check(pa_prober_add(p, named) >= 0, "listening socket with host name added");
+    check(pa_prober_add(p, closed) >= 0, "closed port added");
+
+    check(pa_prober_get(p, listening, NULL) == PA_PROBE_UNKNOWN, "nothing is known before the first probe");
+
+    check(run(m, 1), "all servers probed");
+
+    check(results[0].state == PA_PROBE_REACHABLE, "listening socket is reachable");
+    check(results[0].rtt < PROBE_TIMEOUT_USEC, "round trip time is plausible");
+    check(results[1].state == PA_PROBE_REACHABLE, "listening socket with host name is reachable");
+    check(results[2].state == PA_PROBE_UNREACHABLE, "closed port is unreachable");
+
+    check(pa_prober_get(p, listening, &rtt) == PA_PROBE_REACHABLE && rtt == results[0].rtt, "result of the listening socket is kept");
+    check(pa_prober_get(p, closed, NULL) == PA_PROBE_UNREACHABLE, "result of the closed port is kept");
+
+    /* Once the listener is gone, the next probe has to notice */
+    close(listen_fd);
+
+    check(run(m, 3), "all servers probed again");
+    check(results[0].state == PA_PROBE_UNREACHABLE, "closed listening socket is unreachable");
+    check(results[2].state == PA_PROBE_UNREACHABLE, "closed port stays unreachable");
+
+    pa_prober_remove(p, listening);
+    pa_prober_remove(p, named);
+    pa_prober_remove(p, closed);
+
+    check(pa_prober_get(p, listening, NULL) == PA_PROBE_UNKNOWN, "removed servers are forgotten");
+
+    pa_prober_free(p);
+    pa_mainloop_free(m);
+
+    close(closed_fd);
+
+    return failed ? 1 : 0;
+}